@@ -0,0 +1,355 @@
+/*
+ * Microbenchmark of the cluster bookkeeping of cmpdata: contiguous ranges of
+ * order[] (cmp_range_*) against the union-find bookkeeping used before them,
+ * which is kept here for comparison only.
+ *
+ * Two workloads are run on n files:
+ *  halving - every pass splits every cluster in two until only singletons are left
+ *  pairs   - n / 2 clusters of two identical files followed over many passes
+ *
+ * usage: cmpbench [files] [passes]
+ *
+ * The cache mode compares one size group of files on disk with and without
+ * the page cache probe (CompareOptions.cache_probe), once with the files
+ * dropped from the page cache (cold) and once with them cached (warm):
+ *
+ * usage: cmpbench cache [files] [size] [dir]
+ */
+#include "cmpdata.h"
+#include "fcompare.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct uf_state {
+    int size;
+    int *order;
+    int *parent;
+} uf_state;
+
+static int
+uf_root(uf_state *uf, int idx) {
+    if (uf->parent[idx] < 0) {
+        return uf->parent[idx];
+    }
+    while (idx != uf->parent[idx]) {
+        uf->parent[idx] = uf->parent[uf->parent[idx]];
+        idx = uf->parent[idx];
+    }
+    return idx;
+}
+
+static int
+uf_ordered_same(uf_state *uf, int sidx1, int sidx2) {
+    return uf_root(uf, uf->order[sidx1]) == uf_root(uf, uf->order[sidx2]);
+}
+
+static void
+uf_reset_ordered(uf_state *uf, int sidx, size_t size) {
+    for (size_t i = sidx; i < sidx + size; i++) {
+        uf->parent[uf->order[i]] = -1;
+    }
+}
+
+static void
+uf_union(uf_state *uf, int idx1, int idx2) {
+    int not_set1 = uf->parent[idx1] < 0;
+    int not_set2 = uf->parent[idx2] < 0;
+    if (not_set1 && not_set2) {
+        uf->parent[idx1] = uf->parent[idx2] = idx1;
+    } else if (not_set1) {
+        uf->parent[idx1] = idx2;
+    } else if (not_set2) {
+        uf->parent[idx2] = idx1;
+    } else {
+        int root1 = uf_root(uf, idx1);
+        int root2 = uf_root(uf, idx2);
+        if (root1 != root2) {
+            uf->parent[root2] = root1;
+        }
+    }
+}
+
+static void
+uf_diff(uf_state *uf, int idx1, int idx2) {
+    if (uf->parent[idx1] < 0) {
+        uf->parent[idx1] = idx1;
+    }
+    if (uf->parent[idx2] < 0) {
+        uf->parent[idx2] = idx2;
+    }
+}
+
+static uint32_t
+file_hash(int idx) {
+    uint32_t h = (uint32_t) idx * 2654435761u;
+    h ^= h >> 15;
+    h *= 2246822519u;
+    return h ^ (h >> 13);
+}
+
+// Class of a file in a pass: one hash bit per pass for halving, always 0 for pairs
+static int
+file_class(int idx, int pass, int halving) {
+    return halving ? (int) ((file_hash(idx) >> (pass % 32)) & 1) : 0;
+}
+
+/**
+ * Stable two-way partition of order[sidx, sidx + size) by file_class.
+ * @return number of files of class 0, which come first
+ */
+static int
+split_two(int *order, int *tmp, int sidx, int size, int pass, int halving) {
+    int zeros = 0;
+    for (int i = 0; i < size; i++) {
+        if (file_class(order[sidx + i], pass, halving) == 0) {
+            zeros++;
+        }
+    }
+    int z = 0;
+    int o = zeros;
+    for (int i = 0; i < size; i++) {
+        int idx = order[sidx + i];
+        tmp[file_class(idx, pass, halving) == 0 ? z++ : o++] = idx;
+    }
+    memcpy(order + sidx, tmp, sizeof(int) * size);
+    return zeros;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @return number of clusters of more than one file left
+ */
+static long
+run_uf(int n, int passes, int halving, int *tmp) {
+    uf_state uf;
+    uf.size = n;
+    uf.order = malloc(sizeof(int) * n);
+    uf.parent = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; i++) {
+        uf.order[i] = i;
+        uf.parent[i] = -1;
+    }
+    if (!halving) {
+        for (int i = 0; i + 1 < n; i += 2) {
+            uf_union(&uf, i, i + 1);
+        }
+    }
+    for (int pass = 0; pass < passes; pass++) {
+        int i = 0;
+        int live = 0;
+        while (i < n) {
+            int sidx = i;
+            while (i < n && uf_ordered_same(&uf, sidx, i)) {
+                i++;
+            }
+            int size = i - sidx;
+            if (size < 2) {
+                continue;
+            }
+            live++;
+            uf_reset_ordered(&uf, sidx, size);
+            int zeros = split_two(uf.order, tmp, sidx, size, pass, halving);
+            int first[2] = {-1, -1};
+            for (int k = sidx; k < sidx + size; k++) {
+                int idx = uf.order[k];
+                int c = k - sidx >= zeros;
+                if (first[c] < 0) {
+                    first[c] = idx;
+                    uf_diff(&uf, idx, idx);
+                } else {
+                    uf_union(&uf, first[c], idx);
+                }
+            }
+        }
+        if (live == 0) {
+            break;
+        }
+    }
+    long clusters = 0;
+    int i = 0;
+    while (i < n) {
+        int sidx = i++;
+        while (i < n && uf_ordered_same(&uf, sidx, i)) {
+            i++;
+        }
+        clusters += i - sidx > 1;
+    }
+    free(uf.order);
+    free(uf.parent);
+    return clusters;
+}
+
+static long
+run_ranges(int n, int passes, int halving, int *tmp) {
+    cmpdata cd;
+    if (cmp_init(&cd, n, 0, 0) != 0) {
+        cmp_free(&cd);
+        return -1;
+    }
+    if (!halving) {
+        cmp_range_next_pass(&cd);
+        for (int i = 0; i + 2 < n; i += 2) {
+            cmp_range_split(&cd, i, i + 2);
+            cmp_range_keep(&cd, i);
+        }
+        if (n % 2 == 0) {
+            cmp_range_keep(&cd, n - 2);
+        }
+        cmp_range_next_pass(&cd);
+    }
+    for (int pass = 0; pass < passes && cd.live_count > 0; pass++) {
+        for (int l = 0; l < cd.live_count; l++) {
+            int sidx = cd.live[l];
+            int end = cd.range_end[sidx];
+            int zeros = split_two(cd.order, tmp, sidx, end - sidx, pass, halving);
+            if (zeros > 0 && zeros < end - sidx) {
+                cmp_range_split(&cd, sidx, sidx + zeros);
+            }
+            for (int s = sidx; s < end; s = cd.range_end[s]) {
+                if (cd.range_end[s] - s > 1) {
+                    cmp_range_keep(&cd, s);
+                }
+            }
+        }
+        cmp_range_next_pass(&cd);
+    }
+    long clusters = 0;
+    for (int s = 0; s < n; s = cd.range_end[s]) {
+        clusters += cd.range_end[s] - s > 1;
+    }
+    cmp_free(&cd);
+    return clusters;
+}
+
+static void
+count_set(const DuplicateSet *duplicates, void *user_data) {
+    *(long *) user_data += duplicates->count;
+}
+
+/**
+ * Drop the files from the page cache (cold) or read them into it (warm).
+ */
+static void
+set_cached(char **paths, int n, int warm, char *buf, size_t size) {
+    for (int i = 0; i < n; i++) {
+        int fd = open(paths[i], O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        if (warm) {
+            while (read(fd, buf, size) > 0) {
+            }
+        } else {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Cache mode: files equal but for a byte past the middle in every other file,
+ * compared with and without the cache probe, cold and warm.
+ */
+static int
+run_cache(int n, size_t size, const char *dir) {
+    char **paths = malloc(sizeof(char *) * n);
+    char *buf = malloc(size);
+    if (paths == NULL || buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t k = 0; k < size; k++) {
+        buf[k] = (char) (k * 7);
+    }
+    for (int i = 0; i < n; i++) {
+        paths[i] = malloc(strlen(dir) + 32);
+        sprintf(paths[i], "%s/cmpbench_cache%04d", dir, i);
+        buf[size / 2 + size / 4] = (char) (i % 2);
+        FILE *f = fopen(paths[i], "wb");
+        if (f == NULL || fwrite(buf, 1, size, f) != size || fsync(fileno(f)) != 0) {
+            perror(paths[i]);
+            return 1;
+        }
+        fclose(f);
+    }
+
+    CompareOptions opt;
+    init_compare_options(&opt);
+    opt.max_buffer = 64 * 1024 * 1024;
+    opt.threads = 1;
+    const char *states[] = {"cold", "warm"};
+    for (int warm = 0; warm <= 1; warm++) {
+        double t[2];
+        long found[2];
+        for (int probe = 0; probe <= 1; probe++) {
+            opt.cache_probe = probe;
+            found[probe] = 0;
+            set_cached(paths, n, warm, buf, size);
+            double t0 = now();
+            char *message = NULL;
+            if (compare_files_async_opts(paths, n, &opt, count_set, &found[probe], &message) != 0) {
+                fprintf(stderr, "%s\n", message != NULL ? message : "comparison failed");
+            }
+            free_error_message(message);
+            t[probe] = now() - t0;
+        }
+        printf("cache %s files %d size %zu: no probe %.3f s, cache probe %.3f s (%ld/%ld files in sets)%s\n",
+               states[warm], n, size, t[0], t[1], found[0], found[1], found[0] == found[1] ? "" : " MISMATCH");
+    }
+
+    for (int i = 0; i < n; i++) {
+        remove(paths[i]);
+        free(paths[i]);
+    }
+    free(paths);
+    free(buf);
+    return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "cache") == 0) {
+        int files = argc > 2 ? atoi(argv[2]) : 32;
+        long size = argc > 3 ? atol(argv[3]) : 4 * 1024 * 1024;
+        if (files < 2 || size < 1) {
+            fprintf(stderr, "usage: %s cache [files >= 2] [size >= 1] [dir]\n", argv[0]);
+            return 1;
+        }
+        return run_cache(files, (size_t) size, argc > 4 ? argv[4] : ".");
+    }
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int passes = argc > 2 ? atoi(argv[2]) : 32;
+    if (n < 2 || passes < 1) {
+        fprintf(stderr, "usage: %s [files >= 2] [passes >= 1]\n", argv[0]);
+        return 1;
+    }
+    int *tmp = malloc(sizeof(int) * n);
+    if (tmp == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    const char *names[] = {"pairs", "halving"};
+    for (int halving = 0; halving <= 1; halving++) {
+        double t0 = now();
+        long uf_clusters = run_uf(n, passes, halving, tmp);
+        double t1 = now();
+        long range_clusters = run_ranges(n, passes, halving, tmp);
+        double t2 = now();
+        printf("%-8s files %d passes %d: union-find %.3f s, ranges %.3f s (%ld/%ld clusters)%s\n",
+               names[halving], n, passes, t1 - t0, t2 - t1, uf_clusters, range_clusters,
+               uf_clusters == range_clusters ? "" : " MISMATCH");
+    }
+    free(tmp);
+    return 0;
+}
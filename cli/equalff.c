@@ -2,157 +2,167 @@
 #define _XOPEN_SOURCE 700
 
 #include "fcompare.h"
+#include "fmanage.h"
+#include "fscan.h"
+#include "ftable.h"
 #include "salloc.h"
+#include "wspool.h"
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#ifndef USE_FDS
-#define USE_FDS 15
-#endif
+#define PAIR_BATCH_MAX 256              // pairs of small files compared in one call
+#define PAIR_BATCH_MAX_SIZE (64 * 1024) // larger pairs are compared one by one
+#define JOBS_AHEAD 16                   // jobs per thread that may start past the first one not printed
 
-#define DEFAULT_MAX_OPEN_FILES FOPEN_MAX
+static file_table g_files;
 
+// Output of one job, printed once every earlier job was printed
 typedef struct {
-    char *filepath;
-    off_t st_size;
-} file_item;
-
-typedef struct _item {
-    file_item *fi;
-    struct _item *next;
-} item;
-
-typedef struct {
-    item *list_head;    // Sentinel node for the linked list
-    item *list_tail;    // Points to the last actual item added to the list
-    size_t files_count; // Total number of files collected
-} FileCollectionCtx;
-
-static FileCollectionCtx g_file_collection;
-
-static int cli_global_first_output_emitted = 0; // 0 = false, 1 = true
+    char *data;
+    size_t len;
+    size_t cap;
+} out_buf;
 
 typedef struct {
     int clusters_found_this_call; // Tracks clusters found for a specific call to compare_files_async
+    out_buf *out;
+    const file_table *ft;
+    const file_key *files;        // Same-size group passed to process_same_size_async
+    const int *reps;              // Position in files of each compared inode
+    const int *next_link;         // Next position in files sharing the inode, -1 terminates
+    char *reported;               // Whether an inode was printed as part of a set
 } CliAsyncCallbackLocalContext;
 
-item *
-add_item(item *current_tail, file_item *fi) {
-    current_tail->next = (item *) salloc(sizeof(item), handle_exit);
-    current_tail = current_tail->next;
+// Consecutive size groups of two small files compared in one call
+typedef struct {
+    char *paths[2 * PAIR_BATCH_MAX];
+    int count;
+    int clusters_found;
+    out_buf *out;
+} pair_batch;
+
+typedef enum {
+    JOB_ZERO_SIZE,      // empty files, one set without reading
+    JOB_PAIRS,          // up to PAIR_BATCH_MAX groups of two small files
+    JOB_SAME_SIZE       // one size group
+} job_kind;
+
+// Part of the size-sorted files compared by one worker
+typedef struct {
+    job_kind kind;
+    size_t start;       // range of the sorted file keys
+    size_t end;
+    int clusters;
+    int done;
+    out_buf out;
+} compare_job;
+
+/*
+ * Size groups are compared by a pool of workers. Open files and buffer memory
+ * are one budget shared by the workers, a job waits until its share is free.
+ * Job outputs are printed in job order, so the output does not depend on the
+ * number of workers. Jobs start in order and at most a window of jobs past the
+ * first one not printed, so a slow job holds back a bounded amount of output.
+ */
+typedef struct {
+    const file_table *ft;
+    const file_key *fis;
+    const CompareOptions *cmp_opt;
+    compare_job *jobs;
+    size_t job_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t budget_cond;     // a job finished: its budget is free, the window may have moved
+    size_t buffer_free;     // bytes of max_buffer not used by running jobs
+    int files_free;         // open files of max_open_files not used by running jobs
+    size_t next_print;      // first job whose output was not printed yet
+    size_t next_start;      // first job not started yet
+    size_t window;          // jobs that may start past next_print
+    int threads;            // number of comparing threads
+} compare_run;
 
-    current_tail->fi = fi;
-    current_tail->next = NULL;
-    return current_tail; // The new tail node
-}
+typedef struct {
+    dev_t st_dev;
+    ino_t st_ino;
+    int pos;
+} inode_key;
 
 /**
- * Create array of file_item pointers from linked list.
- * @param list_sentinel_head sentinel head of linked list
- * @param num_files total number of actual files (from g_file_collection.files_count)
- * @return array of file_item pointers
+ * Compare two inode keys by device, inode and position.
+ * @param p1 first inode_key
+ * @param p2 second inode_key
+ * @return -1, 0 or 1
  */
-file_item **
-create_array_from_list(item *list_sentinel_head, size_t num_files) {
-    int i = 0;
-    item *current_node = list_sentinel_head->next; // Start from the first actual item
-    file_item **fis =
-            (file_item **) salloc(sizeof(file_item *) * num_files, handle_exit);
-
-    while (current_node != NULL) {
-        if (i >= num_files) {
-            fprintf(stderr, "Error: More items in list than files_count in create_array_from_list\n");
-            // This indicates a discrepancy, possibly exit or handle error
-            exit(EXIT_FAILURE);
-        }
-        fis[i++] = current_node->fi;
-        current_node = current_node->next;
+int
+cmpinode(const void *p1, const void *p2) {
+    const inode_key *k1 = (const inode_key *) p1;
+    const inode_key *k2 = (const inode_key *) p2;
+
+    if (k1->st_dev != k2->st_dev) {
+        return k1->st_dev < k2->st_dev ? -1 : 1;
     }
-    // After the loop, i should ideally be equal to num_files.
-    // If i < num_files, the list was shorter than expected.
-    if (i != num_files) {
-         fprintf(stderr, "Warning: files_count (%zu) and items copied to array (%d) mismatch.\n", num_files, i);
-         // This might be an issue depending on whether num_files was an exact count or an estimate.
-         // For this program, it should be exact.
+    if (k1->st_ino != k2->st_ino) {
+        return k1->st_ino < k2->st_ino ? -1 : 1;
     }
-    return fis;
+    return (k1->pos > k2->pos) - (k1->pos < k2->pos);
 }
 
 /**
- * Free linked list structure (the item nodes themselves).
- * file_item structs pointed to by fi are freed separately by free_file_items_array.
- * @param list_sentinel_head sentinel head of linked list
+ * Collect regular file found by the directory scanner. See fscan_file_fn.
+ * Every scanner thread appends to its own table, the tables are joined after the scan.
+ * @param user_data array of per-worker file_table
+ * @param worker index of scanner thread
+ * @param filepath path to file
+ * @param path_len length of filepath
+ * @param st file metadata
  */
 void
-free_file_list_nodes(item *list_sentinel_head) {
-    item *current_node = list_sentinel_head->next; // Start with the first actual item
-    while (current_node != NULL) {
-        item *node_to_free = current_node;
-        current_node = current_node->next;
-        free(node_to_free);
-    }
-    free(list_sentinel_head); // Free the sentinel node itself
+process_entry(void *user_data, int worker, const char *filepath, size_t path_len, const fscan_stat *st) {
+    file_table *ft = &((file_table *) user_data)[worker];
+    ft_add(ft, filepath, path_len, st->st_size, st->st_dev, st->st_ino);
 }
 
 /**
- * Free array of file_item pointers and the file_items themselves.
- * @param count number of items in array (from g_file_collection.files_count)
- * @param file_items_array array of file_item pointers
+ * Append a line to a job output, exit when out of memory.
+ * @param out job output
+ * @param line text without the newline
  */
-void
-free_file_items_array(size_t count, file_item **file_items_array) {
-    for (size_t i = 0; i < count; i++) {
-        if (file_items_array[i] != NULL) { // Defensive check
-            free(file_items_array[i]->filepath); // Free the strdup'd path
-            free(file_items_array[i]);          // Free the file_item struct
+static void
+out_line(out_buf *out, const char *line) {
+    size_t n = strlen(line);
+    if (out->len + n + 1 > out->cap) {
+        size_t cap = out->cap > 0 ? out->cap : 256;
+        while (cap < out->len + n + 1) {
+            cap *= 2;
         }
+        char *data = (char *) realloc(out->data, cap);
+        if (data == NULL) {
+            handle_exit();
+        }
+        out->data = data;
+        out->cap = cap;
     }
+    memcpy(out->data + out->len, line, n);
+    out->data[out->len + n] = '\n';
+    out->len += n + 1;
 }
 
 /**
- * Compare two file_item pointers by their size.
- * @param p1 first file_item pointer
- * @param p2 second file_item pointer
- * @return 1 if first is greater, -1 if second is greater, 0 if equal
- */
-int
-cmpsizerev(const void *p1, const void *p2) {
-    file_item **fi1 = (file_item **) p1;
-    file_item **fi2 = (file_item **) p2;
-    off_t a1 = (*fi1)->st_size;
-    off_t a2 = (*fi2)->st_size;
-
-    return (a1 < a2) - (a1 > a2);
-    // return (a1 > a2) - (a1 < a2);
-}
-
-/**
- * Process file entry in directory tree. See nftw(3) for more information.
- * @param filepath path to file
- * @param info stat structure
- * @param typeflag type of file
- * @param pathinfo additional information
- * @return 0
+ * Print all paths of one inode.
+ * @param ctx callback context of the group
+ * @param rep index into ctx->reps
  */
-int
-process_entry(const char *filepath, const struct stat *info, const int typeflag,
-              struct FTW *pathinfo) {
-    if (S_ISREG(info->st_mode)) {
-        file_item *fi =
-                (file_item *) salloc(sizeof(file_item), handle_exit);
-
-        fi->filepath = sstrdup(filepath, handle_exit);
-        fi->st_size = info->st_size;
-
-        g_file_collection.list_tail = add_item(g_file_collection.list_tail, fi);
-        g_file_collection.files_count++;
+static void
+print_inode_paths(CliAsyncCallbackLocalContext *ctx, int rep) {
+    for (int pos = ctx->reps[rep]; pos >= 0; pos = ctx->next_link[pos]) {
+        out_line(ctx->out, ft_path(ctx->ft, ctx->files[pos].idx));
     }
-    return 0;
+    ctx->reported[rep] = 1;
 }
 
 // Callback function to print duplicates as they are found
@@ -160,35 +170,130 @@ static void cli_output_callback(const DuplicateSet *duplicates, void *user_data)
     CliAsyncCallbackLocalContext *local_ctx = (CliAsyncCallbackLocalContext *)user_data;
 
     // The original output format has a blank line before each new set of duplicates.
-    fprintf(stdout, "\n");
+    out_line(local_ctx->out, "");
 
     for (int i = 0; i < duplicates->count; i++) {
-        fprintf(stdout, "%s\n", duplicates->paths[i]);
-    }
-    cli_global_first_output_emitted = 1; // Mark that some output has occurred for overall formatting
-    if (local_ctx) {
-        local_ctx->clusters_found_this_call++;
+        // Each compared path stands for every hardlink of its inode
+        print_inode_paths(local_ctx, duplicates->indices[i]);
     }
+    local_ctx->clusters_found_this_call++;
 }
 
+/**
+ * Compare group of same-size files. Paths sharing a device and inode are
+ * identical without reading them, so only one path per inode is compared and
+ * the others are printed along with it.
+ * @param ft file table
+ * @param files group of file keys of the same size
+ * @param count number of files in group
+ * @param cmp_opt comparison options
+ * @param out output of the group
+ * @return number of duplicate sets printed
+ */
 int
-process_same_size_async(file_item *files[], int count, int max_buffer, int max_open_files) {
-    char **name = (char **) salloc(sizeof(char *) * count, NULL);
-    if (!name) {
-        fprintf(stderr, "Error: Failed to allocate memory for file names in process_same_size_async.\n");
-        return 0;
+process_same_size_async(const file_table *ft, const file_key *files, int count, const CompareOptions *cmp_opt,
+                        out_buf *out) {
+    inode_key *inodes = (inode_key *) salloc(sizeof(inode_key) * count, handle_exit);
+    int *next_link = (int *) salloc(sizeof(int) * count, handle_exit);
+    int *reps = (int *) salloc(sizeof(int) * count, handle_exit);
+    char *is_rep = (char *) salloc(count, handle_exit);
+
+    for (int i = 0; i < count; i++) {
+        inodes[i].st_dev = ft->st_dev[files[i].idx];
+        inodes[i].st_ino = ft->st_ino[files[i].idx];
+        inodes[i].pos = i;
+    }
+    qsort(inodes, count, sizeof(inode_key), cmpinode);
+
+    // Chain the positions of every inode in group order, the first one represents the inode
+    for (int i = 0; i < count; i++) {
+        int same_as_next = i + 1 < count && inodes[i + 1].st_dev == inodes[i].st_dev &&
+                           inodes[i + 1].st_ino == inodes[i].st_ino;
+        next_link[inodes[i].pos] = same_as_next ? inodes[i + 1].pos : -1;
+        is_rep[inodes[i].pos] = i == 0 || inodes[i - 1].st_dev != inodes[i].st_dev ||
+                                inodes[i - 1].st_ino != inodes[i].st_ino;
     }
+    free(inodes);
+
+    int reps_count = 0;
     for (int i = 0; i < count; i++) {
-        name[i] = files[i]->filepath;
+        if (is_rep[i]) {
+            reps[reps_count++] = i;
+        }
     }
+    free(is_rep);
 
     CliAsyncCallbackLocalContext local_cb_ctx = {0};
-    char *error_msg = NULL;
+    local_cb_ctx.out = out;
+    local_cb_ctx.ft = ft;
+    local_cb_ctx.files = files;
+    local_cb_ctx.reps = reps;
+    local_cb_ctx.next_link = next_link;
+    local_cb_ctx.reported = (char *) salloc(reps_count, handle_exit);
+    memset(local_cb_ctx.reported, 0, reps_count);
+
+    if (reps_count > 1) {
+        char **name = (char **) salloc(sizeof(char *) * reps_count, handle_exit);
+        for (int i = 0; i < reps_count; i++) {
+            name[i] = (char *) ft_path(ft, files[reps[i]].idx);
+        }
+
+        char *error_msg = NULL;
+        int ret_code = compare_files_async_opts(name, reps_count, cmp_opt,
+                                                cli_output_callback, &local_cb_ctx, &error_msg);
+        free(name);
+
+        if (ret_code != 0) {
+            fprintf(stderr, "Error during file comparison: %s (Code: %d)\n",
+                    error_msg ? error_msg : strerror(ret_code),
+                    ret_code);
+            if (error_msg) {
+                free_error_message(error_msg);
+            }
+        }
+    }
+
+    // Hardlinks not reported with another inode still form a set of their own
+    for (int i = 0; i < reps_count; i++) {
+        if (!local_cb_ctx.reported[i] && next_link[reps[i]] >= 0) {
+            out_line(out, "");
+            print_inode_paths(&local_cb_ctx, i);
+            local_cb_ctx.clusters_found_this_call++;
+        }
+    }
+
+    free(local_cb_ctx.reported);
+    free(reps);
+    free(next_link);
+    return local_cb_ctx.clusters_found_this_call;
+}
 
-    int ret_code = compare_files_async(name, count, max_buffer, max_open_files,
-                                       cli_output_callback, &local_cb_ctx, &error_msg);
-    free(name);
+// Callback printing a pair of duplicates found by compare_pairs_async
+static void
+pair_output_callback(const DuplicateSet *duplicates, void *user_data) {
+    pair_batch *batch = (pair_batch *) user_data;
+    out_line(batch->out, "");
+    for (int i = 0; i < duplicates->count; i++) {
+        out_line(batch->out, duplicates->paths[i]);
+    }
+    batch->clusters_found++;
+}
 
+/**
+ * Compare the queued pairs with one library call, so small pairs share the setup.
+ * @param batch queued pairs, emptied
+ * @param cmp_opt comparison options
+ * @return number of duplicate sets printed
+ */
+static int
+flush_pairs(pair_batch *batch, const CompareOptions *cmp_opt) {
+    if (batch->count == 0) {
+        return 0;
+    }
+    char *error_msg = NULL;
+    batch->clusters_found = 0;
+    int ret_code = compare_pairs_async(batch->paths, batch->count, cmp_opt,
+                                       pair_output_callback, batch, &error_msg);
     if (ret_code != 0) {
         fprintf(stderr, "Error during file comparison: %s (Code: %d)\n",
                 error_msg ? error_msg : strerror(ret_code),
@@ -196,12 +301,9 @@ process_same_size_async(file_item *files[], int count, int max_buffer, int max_o
         if (error_msg) {
             free_error_message(error_msg);
         }
-        return 0; // Return 0 clusters if an error occurred during the async call itself
     }
-    // If compare_files_async succeeded, errors during salloc/sstrdup in callbacks
-    // are handled internally by the library and shouldn't stop cli_output_callback from being called for other sets.
-    // The number of clusters actually printed and counted is in local_cb_ctx.
-    return local_cb_ctx.clusters_found_this_call;
+    batch->count = 0;
+    return batch->clusters_found;
 }
 
 /**
@@ -222,81 +324,260 @@ print_usage_exit(char *execname) {
     fprintf(stderr,
             "  -b, --max-buffer=SIZE     Set the maximum memory buffer (in bytes) for file comparison (default 8192, min 128)\n");
     fprintf(stderr,
-            "  -o, --max-of=COUNT        Set the maximum number of open files (default %d)\n",
-            DEFAULT_MAX_OPEN_FILES);
+            "  -o, --max-of=COUNT        Set the maximum number of open files and directory handles (default %d, from the process limit)\n",
+            fm_default_limit());
     fprintf(stderr,
             "  -m, --min-file-size=SIZE  Only check files with a size greater than or equal to SIZE (default 1)\n");
+    fprintf(stderr,
+            "  -t, --threads=COUNT       Number of threads scanning directories and comparing files (default: one per CPU)\n");
+    fprintf(stderr,
+            "  -e, --engine=ENGINE       How file contents are obtained: 'read', 'mmap' or 'uring' (default read)\n");
+    fprintf(stderr,
+            "  -p, --probe[=SAMPLES]     Compare the last block (and SAMPLES middle blocks) before reading from the start\n");
+    fprintf(stderr,
+            "  -d, --disk-order=MODE     Read files in the order of their data on the disk: 'auto', 'on' or 'off'\n"
+            "                            (default auto, on for rotational disks)\n");
+    fprintf(stderr,
+            "  -c, --cache-neutral       Leave the page cache as it was, dropping the pages read from uncached files\n");
     fprintf(stderr,
             "  -h, --help                Display this help message and exit\n");
     exit(1);
 }
 
 /**
- * Print files to stdout.
- * @param fi array of file_item pointers
+ * Print files to a job output.
+ * @param ft file table
+ * @param files array of file keys
  * @param count number of items in array
+ * @param out job output
  */
 void
-print_files(file_item **fi, int count) {
-    fprintf(stdout, "\n");
+print_files(const file_table *ft, const file_key *files, int count, out_buf *out) {
+    out_line(out, "");
     for (int i = 0; i < count; i++) {
-        fprintf(stdout, "%s\n", fi[i]->filepath);
+        out_line(out, ft_path(ft, files[i].idx));
     }
 }
 
+/**
+ * End of the size group starting at start.
+ */
+static size_t
+group_end(const file_key *fis, size_t count, size_t start) {
+    size_t end = start + 1;
+    while (end < count && fis[end].st_size == fis[start].st_size) {
+        end++;
+    }
+    return end;
+}
+
+/**
+ * Split the size-sorted files into jobs: every size group is a job, except
+ * consecutive groups of two small files of distinct inodes, which are joined
+ * into pair jobs.
+ * @param ft file table
+ * @param fis size-sorted file keys, groups of at least two files
+ * @param count number of file keys
+ * @param job_count_out number of jobs
+ * @return jobs, to be freed by the caller
+ */
+static compare_job *
+make_jobs(const file_table *ft, const file_key *fis, size_t count, size_t *job_count_out) {
+    size_t capacity = 64;
+    size_t job_count = 0;
+    compare_job *jobs = (compare_job *) salloc(sizeof(compare_job) * capacity, handle_exit);
+
+    size_t current_idx = 0;
+    while (current_idx < count) {
+        size_t start = current_idx;
+        current_idx = group_end(fis, count, start);
+        const file_key *group = &fis[start];
+        int small_pair = current_idx - start == 2 && group[0].st_size > 0 &&
+                         group[0].st_size <= PAIR_BATCH_MAX_SIZE &&
+                         (ft->st_dev[group[0].idx] != ft->st_dev[group[1].idx] ||
+                          ft->st_ino[group[0].idx] != ft->st_ino[group[1].idx]);
+
+        // A pair joins the previous pair job while it has room
+        if (small_pair && job_count > 0 && jobs[job_count - 1].kind == JOB_PAIRS &&
+            jobs[job_count - 1].end == start &&
+            jobs[job_count - 1].end - jobs[job_count - 1].start < 2 * PAIR_BATCH_MAX) {
+            jobs[job_count - 1].end = current_idx;
+            continue;
+        }
+        if (job_count == capacity) {
+            capacity *= 2;
+            compare_job *grown = (compare_job *) realloc(jobs, sizeof(compare_job) * capacity);
+            if (grown == NULL) {
+                handle_exit();
+            }
+            jobs = grown;
+        }
+        compare_job *job = &jobs[job_count++];
+        memset(job, 0, sizeof(compare_job));
+        job->kind = small_pair ? JOB_PAIRS : group[0].st_size == 0 ? JOB_ZERO_SIZE : JOB_SAME_SIZE;
+        job->start = start;
+        job->end = current_idx;
+    }
+    *job_count_out = job_count;
+    return jobs;
+}
+
+/**
+ * Share of the budget a job needs: descriptors of the group (at most the limit)
+ * and its share of the buffer, so that every worker can run a job at once.
+ */
+static void
+job_budget(const compare_run *run, const compare_job *job, size_t *buffer, int *files) {
+    size_t group = job->kind == JOB_PAIRS ? 2 : job->end - job->start;
+    *buffer = 0;
+    *files = 0;
+    if (job->kind == JOB_ZERO_SIZE) {
+        return;
+    }
+    int workers = (size_t) run->threads < run->job_count ? run->threads : (int) run->job_count;
+    *buffer = compare_group_buffer(run->cmp_opt, group, workers);
+    // The files of the group and the directory handles they are reopened from
+    int max_of = run->cmp_opt->max_open_files;
+    int need = group < (size_t) max_of ? fm_limit_for((int) group) : max_of;
+    *files = need < max_of ? need : max_of;
+}
+
+/**
+ * Run the next job in order. Used as wspool task handler, a task stands for
+ * one job but not a given one: the job next_print is always started, so the
+ * workers waiting for the window to move never wait for a job still queued.
+ */
+static void
+run_job(wspool *pool, int worker, void *task, void *ctx) {
+    (void) pool;
+    (void) worker;
+    (void) task;
+    compare_run *run = (compare_run *) ctx;
+
+    pthread_mutex_lock(&run->lock);
+    while (run->next_start >= run->next_print + run->window) {
+        pthread_cond_wait(&run->budget_cond, &run->lock);
+    }
+    compare_job *job = &run->jobs[run->next_start++];
+    size_t buffer;
+    int files;
+    job_budget(run, job, &buffer, &files);
+    while (run->buffer_free < buffer || run->files_free < files) {
+        pthread_cond_wait(&run->budget_cond, &run->lock);
+    }
+    run->buffer_free -= buffer;
+    run->files_free -= files;
+    pthread_mutex_unlock(&run->lock);
+
+    CompareOptions job_opt = *run->cmp_opt;
+    job_opt.max_buffer = (int) buffer;
+    job_opt.max_open_files = files;
+    // A group holding the whole buffer runs alone, its clusters get all threads
+    job_opt.threads = (int) ((size_t) run->threads * buffer / (size_t) run->cmp_opt->max_buffer);
+    if (job_opt.threads < 1) {
+        job_opt.threads = 1;
+    }
+    const file_key *group = &run->fis[job->start];
+    int count = (int) (job->end - job->start);
+    if (job->kind == JOB_ZERO_SIZE) {
+        // All zero-byte files are considered one set of duplicates by original logic
+        print_files(run->ft, group, count, &job->out);
+        job->clusters = 1;
+    } else if (job->kind == JOB_PAIRS) {
+        pair_batch *pairs = (pair_batch *) salloc(sizeof(pair_batch), handle_exit);
+        pairs->out = &job->out;
+        pairs->count = count / 2;
+        for (int i = 0; i < count; i++) {
+            pairs->paths[i] = (char *) ft_path(run->ft, group[i].idx);
+        }
+        job->clusters = flush_pairs(pairs, &job_opt);
+        free(pairs);
+    } else {
+        job->clusters = process_same_size_async(run->ft, group, count, &job_opt, &job->out);
+    }
+
+    // Give the budget back and print every finished job that is next in order
+    pthread_mutex_lock(&run->lock);
+    run->buffer_free += buffer;
+    run->files_free += files;
+    pthread_cond_broadcast(&run->budget_cond);
+    job->done = 1;
+    while (run->next_print < run->job_count && run->jobs[run->next_print].done) {
+        out_buf *out = &run->jobs[run->next_print].out;
+        fwrite(out->data, 1, out->len, stdout);
+        free(out->data);
+        out->data = NULL;
+        run->next_print++;
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
 /**
  * Process files in array.
- * @param fis array of file_item pointers
- * @param num_files_in_array total number of files in fis (from g_file_collection.files_count)
- * @param max_buffer maximum memory buffer for files comparing
- * @param max_open_files maximum open files
+ * @param ft table of all files found
+ * @param cmp_opt comparison options
  * @param min_file_size minimum file size
+ * @param threads number of comparing threads
  */
 void
-process_files_array(file_item **fis, size_t num_files_in_array, int max_buffer, int max_open_files, int min_file_size) {
-    if (num_files_in_array == 0) {
+process_files_array(const file_table *ft, const CompareOptions *cmp_opt, int min_file_size, int threads) {
+    if (ft->count == 0) {
         return;
     }
 
-    qsort(fis, num_files_in_array, sizeof(file_item *), cmpsizerev);
+    // Only files sharing their size with another file survive the grouping
+    file_key *fis = NULL;
+    size_t num_files_in_array = ft_size_groups(ft, min_file_size, &fis);
     fprintf(stderr, "done.\nStarting fast comparison.\n");
 
-    cli_global_first_output_emitted = 0; // Reset for this processing run
-    int stat_cluster_count = 0;
-
-    size_t current_idx = 0;
-    while (current_idx < num_files_in_array) {
-        size_t group_start_idx = current_idx;
-        long long current_group_file_size = fis[group_start_idx]->st_size;
-
-        // Advance current_idx to find the end of the current group of same-sized files
-        current_idx++;
-        while (current_idx < num_files_in_array && fis[current_idx]->st_size == current_group_file_size) {
-            current_idx++;
+    compare_run run;
+    run.ft = ft;
+    run.fis = fis;
+    run.cmp_opt = cmp_opt;
+    run.jobs = make_jobs(ft, fis, num_files_in_array, &run.job_count);
+    run.buffer_free = (size_t) cmp_opt->max_buffer;
+    run.files_free = cmp_opt->max_open_files;
+    run.next_print = 0;
+    run.next_start = 0;
+    run.threads = threads;
+    run.window = (size_t) threads * JOBS_AHEAD;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.budget_cond, NULL);
+
+    wspool pool;
+    if (threads > (int) run.job_count) {
+        threads = run.job_count > 0 ? (int) run.job_count : 1;
+    }
+    if (wspool_init(&pool, threads, run_job, &run) != 0) {
+        handle_exit();
+    }
+    // One task per job, run_job takes the jobs in order whichever task it gets
+    for (size_t i = run.job_count; i > 0; i--) {
+        if (wspool_submit(&pool, (int) ((i - 1) % threads), &run.jobs[i - 1]) != 0) {
+            handle_exit();
         }
+    }
+    int ret = wspool_run(&pool);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot start comparing threads: %s\n", strerror(ret));
+    }
+    wspool_free(&pool);
+    pthread_cond_destroy(&run.budget_cond);
+    pthread_mutex_destroy(&run.lock);
 
-        int count_in_this_group = current_idx - group_start_idx;
-
-        if (count_in_this_group > 1) {
-            // Special handling for zero-byte files if min_file_size allows them
-            if (current_group_file_size == 0 && min_file_size <= 0) {
-                // All zero-byte files are considered one set of duplicates by original logic
-                print_files(&fis[group_start_idx], count_in_this_group);
-                stat_cluster_count++;
-                if(count_in_this_group > 0) cli_global_first_output_emitted = 1; // Mark output occurred
-            }
-            // For non-zero sized files that meet min_file_size criteria
-            else if (current_group_file_size > 0 && current_group_file_size >= min_file_size) {
-                stat_cluster_count += process_same_size_async(&fis[group_start_idx], count_in_this_group, max_buffer, max_open_files);
-            }
-            // Files smaller than min_file_size (and not zero meeting the condition above) are skipped
-        }
+    int stat_cluster_count = 0;
+    int output_emitted = 0;
+    for (size_t i = 0; i < run.job_count; i++) {
+        stat_cluster_count += run.jobs[i].clusters;
+        output_emitted |= run.jobs[i].clusters > 0;
     }
+    free(run.jobs);
+    free(fis);
 
-    if (cli_global_first_output_emitted) {
+    if (output_emitted) {
       fprintf(stdout, "\n"); // Ensure a final newline if any output was made, to separate from stderr summary
     }
-    fprintf(stderr, "Total files being processed: %zu\n", num_files_in_array);
+    fprintf(stderr, "Total files being processed: %zu\n", ft->count);
     // fprintf(stderr, "Total files being read: %d\n", stat_total_readed_files); // This stat is hard to get now
     fprintf(stderr, "Total equality clusters: %d\n", stat_cluster_count);
 }
@@ -307,8 +588,8 @@ process_files_array(file_item **fis, size_t num_files_in_array, int max_buffer,
  * @param folders array of folder names
  * @param opt_same_fs process files only on one filesystem
  * @param opt_follow_symlinks follow symlinks when processing files
- * @param opt_buffer_size maximum memory buffer for files comparing
- * @param opt_max_open_files maximum open files
+ * @param opt_threads number of directory scanning and comparing threads (0 = one per CPU)
+ * @param cmp_opt comparison options (buffer, open files, engine)
  * @param opt_min_file_size minimum file size
  */
 void
@@ -316,56 +597,39 @@ process_folders(int folders_cnt,
                 char **folders,
                 int opt_same_fs,
                 int opt_follow_symlinks,
-                int opt_buffer_size, int opt_max_open_files, int opt_min_file_size) {
+                int opt_threads,
+                const CompareOptions *cmp_opt, int opt_min_file_size) {
+
+    fscan_options scan_opt = {opt_same_fs, opt_follow_symlinks, opt_threads};
+    int workers = fscan_threads(&scan_opt);
 
-    // Initialize the global file collection context
-    g_file_collection.list_head = (item *) salloc(sizeof(item), handle_exit);
-    g_file_collection.list_head->fi = NULL;    // Sentinel node has no file_item
-    g_file_collection.list_head->next = NULL;
-    g_file_collection.list_tail = g_file_collection.list_head; // List is empty, tail is head
-    g_file_collection.files_count = 0;
+    // Every scanner thread collects into its own table, the tables are joined into g_files below
+    file_table *worker_tables = (file_table *) salloc(sizeof(file_table) * workers, handle_exit);
+    for (int i = 0; i < workers; i++) {
+        ft_init(&worker_tables[i]);
+    }
+    ft_init(&g_files);
 
     fprintf(stderr, "Looking for files ... ");
 
-    int flag = 0;
-    if (!opt_follow_symlinks) {
-        flag |= FTW_PHYS;
-    }
-    if (opt_same_fs) {
-        flag |= FTW_MOUNT;
+    int result = fscan_run(folders, folders_cnt, &scan_opt, process_entry, worker_tables);
+    if (result != 0) {
+        fprintf(stderr, "Cannot scan directories: %s\n", strerror(result));
     }
 
-    for (int i = 0; i < folders_cnt; i++) {
-        int result =
-                nftw(folders[i], process_entry, USE_FDS, flag);
-        if (result != 0) {
-            fprintf(stderr, "Cannot process %s: %s\n", folders[i],
-                    strerror(errno));
-        }
+    for (int i = 0; i < workers; i++) {
+        ft_append(&g_files, &worker_tables[i]);
     }
-    if (g_file_collection.files_count > 0) {
-        fprintf(stderr, "%zu files found\nSorting ... ", g_file_collection.files_count);
-
-        file_item **fis = create_array_from_list(g_file_collection.list_head, g_file_collection.files_count);
-
-        process_files_array(fis, g_file_collection.files_count, opt_buffer_size, opt_max_open_files, opt_min_file_size);
-
-        // Cleanup sequence:
-        // 1. Free the content pointed to by the array (file_item structs and their filepaths)
-        free_file_items_array(g_file_collection.files_count, fis);
-        // 2. Free the array of pointers itself
-        free(fis);
-        // 3. Free the linked list nodes (item structs)
-        free_file_list_nodes(g_file_collection.list_head);
+    free(worker_tables);
 
-        // Reset global context pointers for safety, though not strictly necessary if program exits soon
-        g_file_collection.list_head = NULL;
-        g_file_collection.list_tail = NULL;
-        g_file_collection.files_count = 0;
+    if (g_files.count > 0) {
+        fprintf(stderr, "%zu files found\nSorting ... ", g_files.count);
 
+        process_files_array(&g_files, cmp_opt, opt_min_file_size, workers);
     } else {
         fprintf(stderr, "No files to process\n");
     }
+    ft_free(&g_files);
 }
 
 /**
@@ -379,8 +643,14 @@ main(int argc, char *argv[]) {
     int opt_same_fs = 0;
     int opt_follow_symlinks = 0;
     int opt_buffer_size = 8192; // Set a default positive buffer size
-    int opt_max_open_files = DEFAULT_MAX_OPEN_FILES;
+    int opt_max_open_files = fm_default_limit();
     int opt_min_file_size = 1;
+    int opt_threads = 0;
+    CompareEngine opt_engine = COMPARE_ENGINE_READ;
+    int opt_probe = 0;
+    int opt_probe_samples = 0;
+    int opt_seek_order = -1;
+    int opt_cache_neutral = 0;
     char **folders;
 
     static struct option long_options[] = {
@@ -389,13 +659,18 @@ main(int argc, char *argv[]) {
             {"max-buffer",      required_argument, 0, 'b'},
             {"max-of",          required_argument, 0, 'o'},
             {"min-file-size",   required_argument, 0, 'm'},
+            {"threads",         required_argument, 0, 't'},
+            {"engine",          required_argument, 0, 'e'},
+            {"probe",           optional_argument, 0, 'p'},
+            {"disk-order",      required_argument, 0, 'd'},
+            {"cache-neutral",   no_argument,       0, 'c'},
             {"help",            no_argument,       0, 'h'},
             {0, 0,                                 0, 0}
     };
 
     int c;
 
-    while ((c = getopt_long(argc, argv, "fsb:o:m:h", long_options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "fsb:o:m:t:e:p::d:ch", long_options, NULL)) != -1) {
         switch (c) {
             case 'f':
                 opt_same_fs = 1;
@@ -424,6 +699,50 @@ main(int argc, char *argv[]) {
                     print_usage_exit(argv[0]);
                 }
                 break;
+            case 't':
+                opt_threads = atoi(optarg);
+                if (opt_threads <= 0) {
+                    fprintf(stderr, "Error: threads must be a positive integer.\n");
+                    print_usage_exit(argv[0]);
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "read") == 0) {
+                    opt_engine = COMPARE_ENGINE_READ;
+                } else if (strcmp(optarg, "mmap") == 0) {
+                    opt_engine = COMPARE_ENGINE_MMAP;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    opt_engine = COMPARE_ENGINE_URING;
+                } else {
+                    fprintf(stderr, "Error: engine must be 'read', 'mmap' or 'uring'.\n");
+                    print_usage_exit(argv[0]);
+                }
+                break;
+            case 'p':
+                opt_probe = 1;
+                if (optarg != NULL) {
+                    opt_probe_samples = atoi(optarg);
+                    if (opt_probe_samples < 0) {
+                        fprintf(stderr, "Error: probe samples must be a non-negative integer.\n");
+                        print_usage_exit(argv[0]);
+                    }
+                }
+                break;
+            case 'd':
+                if (strcmp(optarg, "auto") == 0) {
+                    opt_seek_order = -1;
+                } else if (strcmp(optarg, "on") == 0) {
+                    opt_seek_order = 1;
+                } else if (strcmp(optarg, "off") == 0) {
+                    opt_seek_order = 0;
+                } else {
+                    fprintf(stderr, "Error: disk-order must be 'auto', 'on' or 'off'.\n");
+                    print_usage_exit(argv[0]);
+                }
+                break;
+            case 'c':
+                opt_cache_neutral = 1;
+                break;
             case 'h':
                 print_usage_exit(argv[0]);
                 break;
@@ -448,8 +767,18 @@ main(int argc, char *argv[]) {
         folders[i - optind] = argv[i];
     }
 
-    process_folders(folder_cnt, folders, opt_same_fs, opt_follow_symlinks,
-                    opt_buffer_size, opt_max_open_files, opt_min_file_size);
+    CompareOptions cmp_opt;
+    init_compare_options(&cmp_opt);
+    cmp_opt.max_buffer = opt_buffer_size;
+    cmp_opt.max_open_files = opt_max_open_files;
+    cmp_opt.engine = opt_engine;
+    cmp_opt.probe_tail = opt_probe;
+    cmp_opt.probe_samples = opt_probe_samples;
+    cmp_opt.seek_order = opt_seek_order;
+    cmp_opt.cache_neutral = opt_cache_neutral;
+
+    process_folders(folder_cnt, folders, opt_same_fs, opt_follow_symlinks, opt_threads,
+                    &cmp_opt, opt_min_file_size);
 
     free(folders);
 
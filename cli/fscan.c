@@ -0,0 +1,417 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "fscan.h"
+#include "salloc.h"
+#include "wspool.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define FSCAN_GETDENTS64
+#endif
+
+#define FSCAN_DENTS_BUFFER 65536
+#define FSCAN_NEED_SIZE 1
+#define FSCAN_NEED_ID   2
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+// Open directory shared by the scan of the directory and its queued subdirectories
+typedef struct fscan_dirref {
+    int fd;
+    int refs;
+} fscan_dirref;
+
+typedef struct fscan_task {
+    fscan_dirref *parent;   // directory the name is opened in, NULL for roots opened by path
+    size_t name;            // offset of the name in path
+    dev_t root_dev;
+    size_t len;
+    char path[];            // full path, only for reporting the files found
+} fscan_task;
+
+typedef struct fscan_worker {
+    char *path;
+    size_t path_capacity;
+    char *dents;
+} fscan_worker;
+
+typedef struct fscan_devino {
+    dev_t dev;
+    ino_t ino;
+    int used;
+} fscan_devino;
+
+typedef struct fscan_ctx {
+    const fscan_options *opt;
+    fscan_file_fn fn;
+    void *user_data;
+    fscan_worker *workers;
+
+    // directories already entered, only maintained when following symlinks
+    pthread_mutex_t visited_lock;
+    fscan_devino *visited;
+    size_t visited_capacity;
+    size_t visited_count;
+} fscan_ctx;
+
+#ifdef FSCAN_GETDENTS64
+struct fscan_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+/**
+ * Stat directory entry asking the kernel only for the fields we need.
+ * @param dirfd directory file descriptor
+ * @param name entry name relative to dirfd
+ * @param follow follow symbolic link
+ * @param need FSCAN_NEED_* mask
+ * @param mode output file type bits
+ * @param st output metadata (st_dev is always filled)
+ * @return 0 on success, -1 on failure
+ */
+static int
+fscan_statat(int dirfd, const char *name, int follow, int need, mode_t *mode, fscan_stat *st) {
+#if defined(__linux__) && defined(STATX_TYPE)
+    struct statx stx;
+    unsigned int mask = STATX_TYPE;
+    if (need & FSCAN_NEED_SIZE) {
+        mask |= STATX_SIZE;
+    }
+    if (need & FSCAN_NEED_ID) {
+        mask |= STATX_INO;
+    }
+    if (statx(dirfd, name, AT_NO_AUTOMOUNT | (follow ? 0 : AT_SYMLINK_NOFOLLOW), mask, &stx) != 0) {
+        return -1;
+    }
+    *mode = stx.stx_mode;
+    st->st_size = (off_t) stx.stx_size;
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_ino = (ino_t) stx.stx_ino;
+#else
+    struct stat sb;
+    (void) need;
+    if (fstatat(dirfd, name, &sb, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+        return -1;
+    }
+    *mode = sb.st_mode;
+    st->st_size = sb.st_size;
+    st->st_dev = sb.st_dev;
+    st->st_ino = sb.st_ino;
+#endif
+    return 0;
+}
+
+/**
+ * Remember a directory as visited.
+ * @return 1 if the directory was not visited before, 0 otherwise
+ */
+static int
+fscan_visit(fscan_ctx *ctx, dev_t dev, ino_t ino) {
+    int fresh = 1;
+    pthread_mutex_lock(&ctx->visited_lock);
+    if ((ctx->visited_count + 1) * 2 > ctx->visited_capacity) {
+        size_t old_capacity = ctx->visited_capacity;
+        fscan_devino *old = ctx->visited;
+        ctx->visited_capacity = old_capacity ? old_capacity * 2 : 1024;
+        ctx->visited = (fscan_devino *) salloc(sizeof(fscan_devino) * ctx->visited_capacity, handle_exit);
+        memset(ctx->visited, 0, sizeof(fscan_devino) * ctx->visited_capacity);
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].used) {
+                size_t h = ((size_t) old[i].ino * 31u + (size_t) old[i].dev) & (ctx->visited_capacity - 1);
+                while (ctx->visited[h].used) {
+                    h = (h + 1) & (ctx->visited_capacity - 1);
+                }
+                ctx->visited[h] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t h = ((size_t) ino * 31u + (size_t) dev) & (ctx->visited_capacity - 1);
+    while (ctx->visited[h].used) {
+        if (ctx->visited[h].dev == dev && ctx->visited[h].ino == ino) {
+            fresh = 0;
+            break;
+        }
+        h = (h + 1) & (ctx->visited_capacity - 1);
+    }
+    if (fresh) {
+        ctx->visited[h].dev = dev;
+        ctx->visited[h].ino = ino;
+        ctx->visited[h].used = 1;
+        ctx->visited_count++;
+    }
+    pthread_mutex_unlock(&ctx->visited_lock);
+    return fresh;
+}
+
+/**
+ * Drop a reference to an open directory, the last one closes it.
+ */
+static void
+fscan_dirref_release(fscan_dirref *ref) {
+    if (__atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(ref->fd);
+        free(ref);
+    }
+}
+
+/**
+ * Queue directory for scanning.
+ * @param parent open directory holding it, NULL to open path itself
+ * @param name offset of the directory name in path
+ */
+static void
+fscan_push_dir(wspool *pool, int worker, fscan_dirref *parent, const char *path, size_t name, size_t len,
+               dev_t root_dev) {
+    fscan_task *task = (fscan_task *) salloc(sizeof(fscan_task) + len + 1, handle_exit);
+    task->parent = parent;
+    task->name = name;
+    task->root_dev = root_dev;
+    task->len = len;
+    memcpy(task->path, path, len + 1);
+    if (parent != NULL) {
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    if (wspool_submit(pool, worker, task) != 0) {
+        handle_exit();
+    }
+}
+
+/**
+ * Process one directory entry. Regular files and directories known from d_type
+ * are handled with the smallest possible stat request (none at all for
+ * directories unless -f or -s need their identity).
+ */
+static void
+fscan_entry(wspool *pool, int worker, fscan_ctx *ctx, const fscan_task *dir, fscan_dirref *ref,
+            const char *name, unsigned char d_type) {
+    int dirfd = ref->fd;
+    const fscan_options *opt = ctx->opt;
+    fscan_worker *w = &ctx->workers[worker];
+    size_t name_len = strlen(name);
+    int need_sep = dir->len > 0 && dir->path[dir->len - 1] != '/';
+    size_t len = dir->len + need_sep + name_len;
+
+    if (len + 1 > w->path_capacity) {
+        free(w->path);
+        w->path_capacity = (len + 1) * 2;
+        w->path = (char *) salloc(w->path_capacity, handle_exit);
+    }
+    memcpy(w->path, dir->path, dir->len);
+    if (need_sep) {
+        w->path[dir->len] = '/';
+    }
+    memcpy(w->path + dir->len + need_sep, name, name_len + 1);
+
+    mode_t mode = 0;
+    fscan_stat st;
+    int have_stat = 0;
+
+    switch (d_type) {
+        case DT_REG:
+            if (fscan_statat(dirfd, name, 0, FSCAN_NEED_SIZE | FSCAN_NEED_ID, &mode, &st) != 0) {
+                return;
+            }
+            have_stat = 1;
+            break;
+        case DT_DIR:
+            mode = S_IFDIR;
+            if (opt->same_fs || opt->follow_symlinks) {
+                if (fscan_statat(dirfd, name, 0, FSCAN_NEED_ID, &mode, &st) != 0) {
+                    return;
+                }
+                have_stat = 1;
+            }
+            break;
+        case DT_LNK:
+            if (!opt->follow_symlinks) {
+                return;
+            }
+            /* fall through */
+        case DT_UNKNOWN:
+            if (fscan_statat(dirfd, name, opt->follow_symlinks, FSCAN_NEED_SIZE | FSCAN_NEED_ID, &mode, &st) != 0) {
+                return;
+            }
+            have_stat = 1;
+            break;
+        default:
+            return;
+    }
+
+    if (have_stat && opt->same_fs && st.st_dev != dir->root_dev) {
+        return;
+    }
+    if (S_ISREG(mode)) {
+        ctx->fn(ctx->user_data, worker, w->path, len, &st);
+    } else if (S_ISDIR(mode)) {
+        if (opt->follow_symlinks && !fscan_visit(ctx, st.st_dev, st.st_ino)) {
+            return;
+        }
+        fscan_push_dir(pool, worker, ref, w->path, len - name_len, len, dir->root_dev);
+    }
+}
+
+/**
+ * Scan one directory. Used as wspool task handler. A subdirectory is opened by
+ * its name in its parent, which stays open while subdirectories are queued:
+ * the path is not walked again from the root, and O_NOFOLLOW applies to the
+ * only component looked up. The directory is opened when its task runs, not
+ * when it is queued, so a directory with many subdirectories holds one descriptor.
+ */
+static void
+fscan_dir(wspool *pool, int worker, void *task_ptr, void *ctx_ptr) {
+    fscan_task *task = (fscan_task *) task_ptr;
+    fscan_ctx *ctx = (fscan_ctx *) ctx_ptr;
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+#ifdef O_NOFOLLOW
+    if (!ctx->opt->follow_symlinks) {
+        flags |= O_NOFOLLOW;
+    }
+#endif
+    int fd;
+    if (task->parent != NULL) {
+        fd = openat(task->parent->fd, task->path + task->name, flags);
+        fscan_dirref_release(task->parent);
+    } else {
+        fd = open(task->path, flags);
+    }
+    if (fd < 0) {
+        free(task);
+        return;
+    }
+    fscan_dirref *ref = (fscan_dirref *) salloc(sizeof(fscan_dirref), handle_exit);
+    ref->fd = fd;
+    ref->refs = 1;
+
+#ifdef FSCAN_GETDENTS64
+    fscan_worker *w = &ctx->workers[worker];
+    if (w->dents == NULL) {
+        w->dents = (char *) salloc(FSCAN_DENTS_BUFFER, handle_exit);
+    }
+    for (;;) {
+        long nread = syscall(SYS_getdents64, fd, w->dents, FSCAN_DENTS_BUFFER);
+        if (nread <= 0) {
+            break;
+        }
+        for (long pos = 0; pos < nread;) {
+            struct fscan_dirent64 *d = (struct fscan_dirent64 *) (w->dents + pos);
+            pos += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            fscan_entry(pool, worker, ctx, task, ref, d->d_name, d->d_type);
+        }
+    }
+#else
+    // The listing gets a descriptor of its own, the queued subdirectories keep the one in ref
+    int list_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+    if (dir == NULL) {
+        if (list_fd >= 0) {
+            close(list_fd);
+        }
+        fscan_dirref_release(ref);
+        free(task);
+        return;
+    }
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+            continue;
+        }
+#ifdef DT_UNKNOWN
+        fscan_entry(pool, worker, ctx, task, ref, d->d_name, d->d_type);
+#else
+        fscan_entry(pool, worker, ctx, task, ref, d->d_name, 0);
+#endif
+    }
+    closedir(dir);
+#endif
+    fscan_dirref_release(ref);
+    free(task);
+}
+
+int
+fscan_threads(const fscan_options *opt) {
+    return opt->threads > 0 ? opt->threads : wspool_cpu_count();
+}
+
+int
+fscan_run(char **roots, int roots_cnt, const fscan_options *opt, fscan_file_fn fn, void *user_data) {
+    fscan_ctx ctx;
+    wspool pool;
+    int nworkers = fscan_threads(opt);
+
+    ctx.opt = opt;
+    ctx.fn = fn;
+    ctx.user_data = user_data;
+    ctx.visited = NULL;
+    ctx.visited_capacity = 0;
+    ctx.visited_count = 0;
+    pthread_mutex_init(&ctx.visited_lock, NULL);
+    ctx.workers = (fscan_worker *) salloc(sizeof(fscan_worker) * nworkers, handle_exit);
+    memset(ctx.workers, 0, sizeof(fscan_worker) * nworkers);
+
+    int ret = wspool_init(&pool, nworkers, fscan_dir, &ctx);
+    if (ret != 0) {
+        free(ctx.workers);
+        pthread_mutex_destroy(&ctx.visited_lock);
+        return ret;
+    }
+
+    for (int i = 0; i < roots_cnt; i++) {
+        struct stat sb;
+        int sret = opt->follow_symlinks ? stat(roots[i], &sb) : lstat(roots[i], &sb);
+        if (sret != 0) {
+            fprintf(stderr, "Cannot process %s: %s\n", roots[i], strerror(errno));
+            continue;
+        }
+        if (S_ISREG(sb.st_mode)) {
+            fscan_stat st = {sb.st_size, sb.st_dev, sb.st_ino};
+            fn(user_data, 0, roots[i], strlen(roots[i]), &st);
+        } else if (S_ISDIR(sb.st_mode)) {
+            if (opt->follow_symlinks && !fscan_visit(&ctx, sb.st_dev, sb.st_ino)) {
+                continue;
+            }
+            fscan_push_dir(&pool, i, NULL, roots[i], 0, strlen(roots[i]), sb.st_dev);
+        }
+    }
+
+    ret = wspool_run(&pool);
+    wspool_free(&pool);
+
+    for (int i = 0; i < nworkers; i++) {
+        free(ctx.workers[i].path);
+        free(ctx.workers[i].dents);
+    }
+    free(ctx.workers);
+    free(ctx.visited);
+    pthread_mutex_destroy(&ctx.visited_lock);
+    return ret;
+}
@@ -0,0 +1,50 @@
+#ifndef _FSCAN_H
+#define _FSCAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct fscan_options {
+    int same_fs;          // do not leave the filesystem of each root (-f)
+    int follow_symlinks;  // follow symbolic links to files and directories (-s)
+    int threads;          // number of scanner threads, <= 0 means one per CPU
+} fscan_options;
+
+typedef struct fscan_stat {
+    off_t st_size;
+    dev_t st_dev;
+    ino_t st_ino;
+} fscan_stat;
+
+/**
+ * Called for every regular file found. Calls come from several threads at once,
+ * but never concurrently for the same worker index.
+ * @param user_data pointer passed to fscan_run
+ * @param worker index of the calling scanner thread (0 .. threads-1)
+ * @param filepath path of the file (valid only during the call)
+ * @param path_len length of filepath
+ * @param st file metadata
+ */
+typedef void (*fscan_file_fn)(void *user_data, int worker, const char *filepath, size_t path_len,
+                              const fscan_stat *st);
+
+/**
+ * Resolve the number of scanner threads for the given options.
+ * @param opt scanner options
+ * @return number of worker indexes fscan_run will use
+ */
+int fscan_threads(const fscan_options *opt);
+
+/**
+ * Walk directory trees in parallel and report regular files.
+ * Roots that cannot be accessed are reported to stderr and skipped.
+ * @param roots array of root paths (directories or files)
+ * @param roots_cnt number of roots
+ * @param opt scanner options
+ * @param fn callback for regular files
+ * @param user_data pointer passed to fn
+ * @return 0 on success, errno-like code if the scanner could not be started
+ */
+int fscan_run(char **roots, int roots_cnt, const fscan_options *opt, fscan_file_fn fn, void *user_data);
+
+#endif
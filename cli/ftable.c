@@ -0,0 +1,228 @@
+#include "ftable.h"
+#include "salloc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FT_INITIAL_ROWS 4096
+#define FT_INITIAL_PATHS (FT_INITIAL_ROWS * 64)
+#define FT_RADIX_BITS 11
+#define FT_RADIX_BUCKETS (1 << FT_RADIX_BITS)
+
+/**
+ * Grow memory block to new_size bytes, exit on failure.
+ */
+static void *
+ft_grow(void *ptr, size_t new_size) {
+    void *ref = realloc(ptr, new_size);
+    if (ref == NULL) {
+        handle_exit();
+    }
+    return ref;
+}
+
+/**
+ * Make room for at least rows rows and paths_len bytes of paths.
+ */
+static void
+ft_reserve(file_table *ft, size_t rows, size_t paths_len) {
+    if (rows > ft->capacity) {
+        size_t capacity = ft->capacity ? ft->capacity : FT_INITIAL_ROWS;
+        while (capacity < rows) {
+            capacity *= 2;
+        }
+        ft->st_size = (off_t *) ft_grow(ft->st_size, sizeof(off_t) * capacity);
+        ft->st_dev = (dev_t *) ft_grow(ft->st_dev, sizeof(dev_t) * capacity);
+        ft->st_ino = (ino_t *) ft_grow(ft->st_ino, sizeof(ino_t) * capacity);
+        ft->path_off = (size_t *) ft_grow(ft->path_off, sizeof(size_t) * capacity);
+        ft->capacity = capacity;
+    }
+    if (paths_len > ft->paths_capacity) {
+        size_t capacity = ft->paths_capacity ? ft->paths_capacity : FT_INITIAL_PATHS;
+        while (capacity < paths_len) {
+            capacity *= 2;
+        }
+        ft->paths = (char *) ft_grow(ft->paths, capacity);
+        ft->paths_capacity = capacity;
+    }
+}
+
+void
+ft_init(file_table *ft) {
+    memset(ft, 0, sizeof(file_table));
+}
+
+void
+ft_add(file_table *ft, const char *filepath, size_t path_len, off_t st_size, dev_t st_dev, ino_t st_ino) {
+    ft_reserve(ft, ft->count + 1, ft->paths_len + path_len + 1);
+
+    ft->st_size[ft->count] = st_size;
+    ft->st_dev[ft->count] = st_dev;
+    ft->st_ino[ft->count] = st_ino;
+    ft->path_off[ft->count] = ft->paths_len;
+    memcpy(ft->paths + ft->paths_len, filepath, path_len);
+    ft->paths[ft->paths_len + path_len] = '\0';
+
+    ft->paths_len += path_len + 1;
+    ft->count++;
+}
+
+void
+ft_append(file_table *dst, file_table *src) {
+    if (dst->capacity == 0 && dst->paths_capacity == 0) {
+        *dst = *src; // nothing to merge into, just take over the columns
+        ft_init(src);
+        return;
+    }
+    if (src->count > 0) {
+        ft_reserve(dst, dst->count + src->count, dst->paths_len + src->paths_len);
+
+        memcpy(dst->st_size + dst->count, src->st_size, sizeof(off_t) * src->count);
+        memcpy(dst->st_dev + dst->count, src->st_dev, sizeof(dev_t) * src->count);
+        memcpy(dst->st_ino + dst->count, src->st_ino, sizeof(ino_t) * src->count);
+        for (size_t i = 0; i < src->count; i++) {
+            dst->path_off[dst->count + i] = src->path_off[i] + dst->paths_len;
+        }
+        memcpy(dst->paths + dst->paths_len, src->paths, src->paths_len);
+
+        dst->count += src->count;
+        dst->paths_len += src->paths_len;
+    }
+    ft_free(src);
+}
+
+/**
+ * LSD radix sort of keys by descending size. Digits are taken from (max - size),
+ * passes stop at the highest set bit and passes with a single bucket are skipped.
+ * @param keys keys to sort
+ * @param tmp scratch array of the same length
+ * @param n number of keys
+ * @param max_size largest size among keys
+ */
+static void
+ft_radix_sort(file_key *keys, file_key *tmp, size_t n, uint64_t max_size) {
+    size_t *bucket = (size_t *) salloc(sizeof(size_t) * FT_RADIX_BUCKETS, handle_exit);
+    file_key *src = keys;
+    file_key *dst = tmp;
+
+    for (int shift = 0; shift < 64 && (max_size >> shift) != 0; shift += FT_RADIX_BITS) {
+        memset(bucket, 0, sizeof(size_t) * FT_RADIX_BUCKETS);
+        for (size_t i = 0; i < n; i++) {
+            bucket[((max_size - (uint64_t) src[i].st_size) >> shift) & (FT_RADIX_BUCKETS - 1)]++;
+        }
+        if (bucket[((max_size - (uint64_t) src[0].st_size) >> shift) & (FT_RADIX_BUCKETS - 1)] == n) {
+            continue; // every key has the same digit
+        }
+        size_t pos = 0;
+        for (int b = 0; b < FT_RADIX_BUCKETS; b++) {
+            size_t cnt = bucket[b];
+            bucket[b] = pos;
+            pos += cnt;
+        }
+        for (size_t i = 0; i < n; i++) {
+            dst[bucket[((max_size - (uint64_t) src[i].st_size) >> shift) & (FT_RADIX_BUCKETS - 1)]++] = src[i];
+        }
+        file_key *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != keys) {
+        memcpy(keys, src, sizeof(file_key) * n);
+    }
+    free(bucket);
+}
+
+// Row of a size group being ordered by path
+typedef struct ft_path_key {
+    const char *path;
+    size_t idx;
+} ft_path_key;
+
+static int
+ft_path_cmp(const void *a, const void *b) {
+    return strcmp(((const ft_path_key *) a)->path, ((const ft_path_key *) b)->path);
+}
+
+/**
+ * Order the rows of a size group by path, so that neither the comparison nor
+ * the output depends on which scanner thread found which file.
+ * @param tmp scratch space for count rows
+ */
+static void
+ft_sort_by_path(const file_table *ft, file_key *keys, size_t count, ft_path_key *tmp) {
+    for (size_t i = 0; i < count; i++) {
+        tmp[i].path = ft_path(ft, keys[i].idx);
+        tmp[i].idx = keys[i].idx;
+    }
+    qsort(tmp, count, sizeof(ft_path_key), ft_path_cmp);
+    for (size_t i = 0; i < count; i++) {
+        keys[i].idx = tmp[i].idx;
+    }
+}
+
+size_t
+ft_size_groups(const file_table *ft, off_t min_size, file_key **keys_out) {
+    size_t n = 0;
+    uint64_t max_size = 0;
+
+    *keys_out = NULL;
+    for (size_t i = 0; i < ft->count; i++) {
+        n += ft->st_size[i] >= min_size;
+    }
+    if (n < 2) {
+        return 0;
+    }
+
+    file_key *keys = (file_key *) salloc(sizeof(file_key) * n, handle_exit);
+    file_key *tmp = (file_key *) salloc(sizeof(file_key) * n, handle_exit);
+    n = 0;
+    for (size_t i = 0; i < ft->count; i++) {
+        if (ft->st_size[i] >= min_size) {
+            keys[n].st_size = ft->st_size[i];
+            keys[n].idx = i;
+            if ((uint64_t) ft->st_size[i] > max_size) {
+                max_size = (uint64_t) ft->st_size[i];
+            }
+            n++;
+        }
+    }
+    ft_radix_sort(keys, tmp, n, max_size);
+    free(tmp);
+
+    // Drop sizes that occur only once, keeping the order of the remaining groups
+    ft_path_key *by_path = NULL;
+    size_t kept = 0;
+    size_t i = 0;
+    while (i < n) {
+        size_t j = i + 1;
+        while (j < n && keys[j].st_size == keys[i].st_size) {
+            j++;
+        }
+        if (j - i > 1) {
+            if (by_path == NULL) {
+                by_path = (ft_path_key *) salloc(sizeof(ft_path_key) * n, handle_exit);
+            }
+            ft_sort_by_path(ft, &keys[i], j - i, by_path);
+            memmove(&keys[kept], &keys[i], sizeof(file_key) * (j - i));
+            kept += j - i;
+        }
+        i = j;
+    }
+    free(by_path);
+    if (kept == 0) {
+        free(keys);
+        return 0;
+    }
+    *keys_out = keys;
+    return kept;
+}
+
+void
+ft_free(file_table *ft) {
+    free(ft->st_size);
+    free(ft->st_dev);
+    free(ft->st_ino);
+    free(ft->path_off);
+    free(ft->paths);
+    ft_init(ft);
+}
@@ -0,0 +1,87 @@
+#ifndef _FTABLE_H
+#define _FTABLE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * File table: one row per regular file, stored column-wise.
+ * Paths are packed NUL-terminated into one blob and referenced by offset,
+ * so growing the table never invalidates a row, only raw path pointers.
+ */
+typedef struct file_table {
+    size_t count;
+    size_t capacity;
+    off_t *st_size;
+    dev_t *st_dev;
+    ino_t *st_ino;
+    size_t *path_off;
+
+    char *paths;
+    size_t paths_len;
+    size_t paths_capacity;
+} file_table;
+
+/*
+ * Sort key of a row: its size and its index in the file table.
+ */
+typedef struct file_key {
+    off_t st_size;
+    size_t idx;
+} file_key;
+
+/**
+ * Initialize empty file table.
+ * @param ft file table
+ */
+void ft_init(file_table *ft);
+
+/**
+ * Append row. Exits on allocation failure (see handle_exit).
+ * @param ft file table
+ * @param filepath path to file
+ * @param path_len length of filepath
+ * @param st_size file size
+ * @param st_dev device of file
+ * @param st_ino inode of file
+ */
+void ft_add(file_table *ft, const char *filepath, size_t path_len, off_t st_size, dev_t st_dev, ino_t st_ino);
+
+/**
+ * Move all rows of src to the end of dst. src is left empty and released.
+ * @param dst destination table
+ * @param src source table
+ */
+void ft_append(file_table *dst, file_table *src);
+
+/**
+ * Path of row. The pointer is invalidated by the next ft_add/ft_append on ft.
+ * @param ft file table
+ * @param idx row index
+ * @return path string
+ */
+static inline const char *
+ft_path(const file_table *ft, size_t idx) {
+    return ft->paths + ft->path_off[idx];
+}
+
+/**
+ * Group rows by size in linear time.
+ * Rows with size >= min_size are radix sorted by descending size, rows of one size
+ * are then ordered by path, and sizes that occur only once are dropped. The order
+ * does not depend on the order rows were added in.
+ * @param ft file table
+ * @param min_size smallest size to keep
+ * @param keys_out output array of keys, consecutive keys of equal size form one group;
+ *        must be freed by the caller (NULL if nothing is left)
+ * @return number of keys in keys_out
+ */
+size_t ft_size_groups(const file_table *ft, off_t min_size, file_key **keys_out);
+
+/**
+ * Release all memory of the table.
+ * @param ft file table
+ */
+void ft_free(file_table *ft);
+
+#endif
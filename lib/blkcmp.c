@@ -0,0 +1,136 @@
+#include "blkcmp.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BLK_HAVE_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t (*blk_kernel)(const unsigned char *a, const unsigned char *b, size_t n);
+
+/**
+ * Portable kernel: find the first differing machine word, then the byte in it.
+ */
+static size_t
+blk_mismatch_generic(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t wa;
+        uint64_t wb;
+        memcpy(&wa, a + i, sizeof(wa));
+        memcpy(&wb, b + i, sizeof(wb));
+        if (wa != wb) {
+            break;
+        }
+    }
+    for (; i < n; i++) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#ifdef BLK_HAVE_X86
+
+__attribute__((target("sse2")))
+static size_t
+blk_mismatch_sse2(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        unsigned int neq = ~(unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFFu;
+        if (neq != 0) {
+            return i + (size_t) __builtin_ctz(neq);
+        }
+    }
+    return i + blk_mismatch_generic(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+blk_mismatch_avx2(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        unsigned int neq = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (neq != 0) {
+            return i + (size_t) __builtin_ctz(neq);
+        }
+    }
+    return i + blk_mismatch_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t
+blk_mismatch_avx512(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i va = _mm512_loadu_si512((const void *) (a + i));
+        __m512i vb = _mm512_loadu_si512((const void *) (b + i));
+        uint64_t neq = (uint64_t) _mm512_cmpneq_epi8_mask(va, vb);
+        if (neq != 0) {
+            return i + (size_t) __builtin_ctzll(neq);
+        }
+    }
+    return i + blk_mismatch_avx2(a + i, b + i, n - i);
+}
+
+#endif
+
+static blk_kernel blk_selected = blk_mismatch_generic;
+static const char *blk_selected_name = "generic";
+static pthread_once_t blk_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Pick the widest kernel the CPU supports, once for all threads.
+ */
+static void
+blk_select_once(void) {
+#ifdef BLK_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512f")) {
+        blk_selected = blk_mismatch_avx512;
+        blk_selected_name = "avx512bw";
+    } else if (__builtin_cpu_supports("avx2")) {
+        blk_selected = blk_mismatch_avx2;
+        blk_selected_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        blk_selected = blk_mismatch_sse2;
+        blk_selected_name = "sse2";
+    }
+#endif
+}
+
+static blk_kernel
+blk_select(void) {
+    pthread_once(&blk_once, blk_select_once);
+    return blk_selected;
+}
+
+size_t
+blk_mismatch(const void *a, const void *b, size_t n) {
+    return blk_select()((const unsigned char *) a, (const unsigned char *) b, n);
+}
+
+int
+blk_compare(const void *a, const void *b, size_t n, size_t *mismatch_out) {
+    size_t off = blk_mismatch(a, b, n);
+    if (mismatch_out != NULL) {
+        *mismatch_out = off;
+    }
+    if (off == n) {
+        return 0;
+    }
+    return (int) ((const unsigned char *) a)[off] - (int) ((const unsigned char *) b)[off];
+}
+
+const char *
+blk_kernel_name(void) {
+    blk_select();
+    return blk_selected_name;
+}
@@ -0,0 +1,36 @@
+#ifndef _BLKCMP_H
+#define _BLKCMP_H
+
+#include <stddef.h>
+
+/*
+ * Block comparison kernel. On x86 the widest of SSE2, AVX2 and AVX-512BW
+ * supported by the CPU is picked at the first call, elsewhere a word-wise
+ * loop is used.
+ */
+
+/**
+ * Offset of the first byte that differs in two blocks.
+ * @param a first block
+ * @param b second block
+ * @param n number of bytes to compare
+ * @return offset of the first mismatch, n if the blocks are equal
+ */
+size_t blk_mismatch(const void *a, const void *b, size_t n);
+
+/**
+ * Compare two blocks like memcmp, scanning them only once.
+ * @param a first block
+ * @param b second block
+ * @param n number of bytes to compare
+ * @param mismatch_out offset of the first mismatch (n if equal), may be NULL
+ * @return <0, 0, >0 as memcmp
+ */
+int blk_compare(const void *a, const void *b, size_t n, size_t *mismatch_out);
+
+/**
+ * Name of the kernel in use ("avx512bw", "avx2", "sse2" or "generic").
+ */
+const char *blk_kernel_name(void);
+
+#endif
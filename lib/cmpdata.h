@@ -6,15 +6,25 @@
 #include <stdio.h>
 
 #define BUFFER_SIZE 32768
+#define MIN_BUFFER_PER_FILE 128
+#define BLOCK_START 4096            // first block of a file
+#define BLOCK_MAX (2 * 1024 * 1024) // blocks double every pass up to this size
 
 typedef struct cmpdata {
     int size;
     fm_FILE **file;
     int *order;
-    int *uf_parent;
-    char **data;
-    size_t readed;
-    size_t buffer_size;
+    int *range_end;         // for the first position of each range of order: position after its last file
+    int *live;              // first positions of the ranges compared in the current pass
+    int live_count;
+    int *live_next;         // ranges kept for the next pass
+    int live_next_count;
+    const char **block;     // data of the current block of each file (arena or mapped memory)
+    char *arena;            // read buffers, shared by the files of the group being read
+    size_t arena_size;
+    size_t budget;          // total buffer budget of the comparison
+    size_t *block_len;      // number of bytes in the current block of each file
+    size_t buffer_size;     // size of the first block, later blocks grow from it
 } cmpdata;
 
 /**
@@ -22,22 +32,52 @@ typedef struct cmpdata {
  * @param cd cmpdata structure to initialize.
  * @param size number of files to manage.
  * @param max_buffer maximal total buffer size for all files.
+ * @param use_buffers allocate the read buffer arena; when 0 the blocks are only pointed to (mapped files)
  * @return 0 on success, non-zero (e.g., ENOMEM or EINVAL) on failure.
  *         On failure, the state of cd is undefined and should not be used, except for passing to cmp_free if some allocations succeeded.
  */
-int cmp_init(cmpdata *cd, int size, size_t max_buffer);
+int cmp_init(cmpdata *cd, int size, size_t max_buffer, int use_buffers);
 
-int cmp_uf_ordered_same(cmpdata *cd, int sidx1, int sidx2);
-
-int cmp_uf_same(cmpdata *cd, int idx1, int idx2);
+/**
+ * Block size for a pass. Blocks start at buffer_size and double every pass,
+ * since a group that is still together after a pass is likely to stay together,
+ * up to a few megabytes. The blocks of all files of the group must fit the arena.
+ * @param cd cmpdata structure
+ * @param pass number of passes done so far
+ * @param group_size number of files of the group to be read
+ * @param align block alignment (st_blksize), 0 for none; smaller blocks are kept as they are
+ * @param arena_size buffer shared by the blocks of the group, 0 if they are not copied (mapped in place)
+ * @return block size in bytes
+ */
+size_t cmp_block_size(const cmpdata *cd, int pass, size_t group_size, size_t align, size_t arena_size);
 
-int cmp_uf_root(cmpdata *cd, int idx);
+/*
+ * Clusters are contiguous ranges of order[]. Ranges tile order[] and every
+ * range knows its end, so clusters are found by jumping from range to range.
+ * Only ranges of more than one file still being read are listed in live[],
+ * singletons and finished clusters are never visited again.
+ */
 
-void cmp_uf_reset_ordered(cmpdata *cd, int sidx, size_t size);
+/**
+ * Split a range in two.
+ * @param cd cmpdata structure
+ * @param sidx first position of the range
+ * @param at first position of the second part, sidx < at < end of the range
+ */
+void cmp_range_split(cmpdata *cd, int sidx, int at);
 
-void cmp_uf_diff(cmpdata *cd, int idx1, int idx2);
+/**
+ * Keep a range for the next pass.
+ * @param cd cmpdata structure
+ * @param sidx first position of the range
+ */
+void cmp_range_keep(cmpdata *cd, int sidx);
 
-void cmp_uf_union(cmpdata *cd, int idx1, int idx2);
+/**
+ * Start the next pass with the ranges kept during the current one.
+ * @param cd cmpdata structure
+ */
+void cmp_range_next_pass(cmpdata *cd);
 
 void cmp_free(cmpdata *cd);
 
@@ -1,10 +1,14 @@
+#include "blkcmp.h"
 #include "cmpdata.h"
 #include "fcompare.h"
+#include "fring.h"
 #include "salloc.h"
+#include "wspool.h"
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h> // For SIZE_MAX if needed, or use a large number
+#include <stdint.h>
 
 // Context structure for the adapter - MOVED BEFORE CALLBACK
 struct CompareFilesAsyncAdapterContext {
@@ -33,6 +37,7 @@ static void compare_files_adapter_callback(const DuplicateSet *duplicates_from_a
     DuplicateSet *current_target_set = &result->sets[result->count];
     current_target_set->paths = NULL;
     current_target_set->count = 0;
+    current_target_set->indices = NULL;
 
     current_target_set->paths = (char **)salloc((duplicates_from_async->count) * sizeof(char *), NULL); // Pass NULL for error_handle
     if (!current_target_set->paths) {
@@ -61,6 +66,15 @@ static void compare_files_adapter_callback(const DuplicateSet *duplicates_from_a
         paths_copied++;
     }
     current_target_set->count = paths_copied;
+    current_target_set->indices = (int *)salloc(paths_copied * sizeof(int), NULL);
+    if (current_target_set->indices) {
+        memcpy(current_target_set->indices, duplicates_from_async->indices, paths_copied * sizeof(int));
+    } else {
+        if (result->error_message == NULL) {
+            result->error_message = sstrdup("Adapter: Failed to salloc indices for set.", NULL);
+        }
+        result->error_code = ENOMEM;
+    }
     result->count++;
 }
 
@@ -75,72 +89,194 @@ static int add_duplicate_set(ComparisonResult *result, char *name[], const int o
 }
 */
 
-int
-#if defined(__APPLE__) || defined(_WIN32) || defined(_WIN64)
-// For Apple and Windows (MinGW qsort_s), the comparator takes context as the first argument.
-ufsorter(void *arg, const void *p1, const void *p2)
-#else
-// For GNU qsort_r, the comparator takes context as the last argument.
-ufsorter(const void *p1, const void *p2, void *arg)
-#endif
-{
-    int f1_idx = *((int *) p1);
-    int f2_idx = *((int *) p2);
-    cmpdata *cd = (cmpdata *) arg;
-
-    if (f1_idx < 0 || f1_idx >= cd->size || f2_idx < 0 || f2_idx >= cd->size) {
-        return 0;
+// A file and a 64-bit key: the hash of its block in a large group, or the
+// physical offset of its next read
+typedef struct {
+    uint64_t fp;
+    int idx;
+    int ended;      // the block reached the end of the file
+} fp_entry;
+
+static int
+fp_entry_cmp(const void *p1, const void *p2) {
+    const fp_entry *e1 = (const fp_entry *) p1;
+    const fp_entry *e2 = (const fp_entry *) p2;
+    if (e1->fp != e2->fp) {
+        return e1->fp < e2->fp ? -1 : 1;
     }
+    return e1->idx < e2->idx ? -1 : e1->idx > e2->idx;
+}
 
-    int f1_struct_null = (cd->file[f1_idx] == NULL);
-    int f2_struct_null = (cd->file[f2_idx] == NULL);
+/*
+ * Scratch space for splitting a group by its current blocks in linear time.
+ * Files are bucketed by a sampled fingerprint of their block, and a block is
+ * compared only with the representative of each class sharing its fingerprint.
+ */
+typedef struct partitioner {
+    int *slot;          // hash slots, first class of a fingerprint or -1
+    size_t slots;       // number of slots, a power of two
+    uint64_t *cls_fp;   // fingerprint of each class
+    int *cls_rep;       // representative file of each class
+    int *cls_next;      // next class with the same fingerprint, -1 if none
+    int *cls_start;     // number of files, then first position of each class
+    int *file_cls;      // class of each file of the group by position, -1 if failed
+    int *tmp;           // rebuilt order of the group
+    fp_entry *reads;    // positions of the group in the order their blocks are read
+} partitioner;
 
-    if (f1_struct_null && f2_struct_null) {
-        cmp_uf_diff(cd, f1_idx, f2_idx);
-        return 0;
+// Words of a block mixed into its fingerprint
+#define FP_SAMPLES 16
+
+/**
+ * @param count maximum number of files in a group
+ * @return 0 on success, ENOMEM on failure
+ */
+static int
+part_init(partitioner *pt, int count) {
+    pt->slots = 2;
+    while (pt->slots < (size_t) count * 2) {
+        pt->slots <<= 1;
     }
-    if (f1_struct_null || f2_struct_null) {
-        cmp_uf_diff(cd, f1_idx, f2_idx);
-        return f1_struct_null ? -1 : 1;
+    pt->slot = (int *) salloc(sizeof(int) * pt->slots, NULL);
+    pt->cls_fp = (uint64_t *) salloc(sizeof(uint64_t) * count, NULL);
+    pt->cls_rep = (int *) salloc(sizeof(int) * count, NULL);
+    pt->cls_next = (int *) salloc(sizeof(int) * count, NULL);
+    pt->cls_start = (int *) salloc(sizeof(int) * count, NULL);
+    pt->file_cls = (int *) salloc(sizeof(int) * count, NULL);
+    pt->tmp = (int *) salloc(sizeof(int) * count, NULL);
+    pt->reads = (fp_entry *) salloc(sizeof(fp_entry) * count, NULL);
+    if (!pt->slot || !pt->cls_fp || !pt->cls_rep || !pt->cls_next || !pt->cls_start
+        || !pt->file_cls || !pt->tmp || !pt->reads) {
+        return ENOMEM;
     }
+    return 0;
+}
 
-    int f1_open_failed = (cd->file[f1_idx]->fd == NULL && cd->file[f1_idx]->_errno != 0);
-    int f2_open_failed = (cd->file[f2_idx]->fd == NULL && cd->file[f2_idx]->_errno != 0);
+static void
+part_free(partitioner *pt) {
+    free(pt->slot);
+    free(pt->cls_fp);
+    free(pt->cls_rep);
+    free(pt->cls_next);
+    free(pt->cls_start);
+    free(pt->file_cls);
+    free(pt->tmp);
+    free(pt->reads);
+}
 
-    if (f1_open_failed && f2_open_failed) {
-        cmp_uf_diff(cd, f1_idx, f2_idx);
-        return 0;
+static uint64_t
+fp_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 31);
+}
+
+/**
+ * Fingerprint of a block made of FP_SAMPLES words spread over it, cheap enough
+ * to be taken for every file of every pass. Equal blocks have equal fingerprints.
+ */
+static uint64_t
+block_fingerprint(const char *block, size_t n) {
+    uint64_t h = n;
+    if (n < sizeof(uint64_t)) {
+        for (size_t i = 0; i < n; i++) {
+            h = fp_mix(h, (unsigned char) block[i]);
+        }
+        return h;
     }
-    if (f1_open_failed || f2_open_failed) {
-        cmp_uf_diff(cd, f1_idx, f2_idx);
-        return f1_open_failed ? -1 : 1;
+    size_t last = n - sizeof(uint64_t);
+    for (size_t i = 0; i < FP_SAMPLES; i++) {
+        uint64_t w;
+        memcpy(&w, block + last * i / (FP_SAMPLES - 1), sizeof(w));
+        h = fp_mix(h, w);
     }
+    return h;
+}
 
-    int f1_has_read_error = (cd->file[f1_idx]->_errno != 0 && (cd->file[f1_idx]->fd == NULL || !feof(cd->file[f1_idx]->fd)) );
-    int f2_has_read_error = (cd->file[f2_idx]->_errno != 0 && (cd->file[f2_idx]->fd == NULL || !feof(cd->file[f2_idx]->fd)) );
-
-    if (f1_has_read_error && f2_has_read_error) {
-        cmp_uf_diff(cd, f1_idx, f2_idx);
-        return 0;
+/**
+ * Split the group range of cd->order by the current blocks. Files that failed
+ * come first as singletons, then the classes of equal blocks in the order they
+ * were met, each class becoming a range of its own.
+ */
+static void
+partition_group(partitioner *pt, cmpdata *cd, int sidx, size_t size) {
+    size_t mask = 1;
+    while (mask < size * 2 && mask < pt->slots) {
+        mask <<= 1;
     }
-    if (f1_has_read_error || f2_has_read_error) {
-        cmp_uf_diff(cd, f1_idx, f2_idx);
-        return f1_has_read_error ? -1 : 1;
+    mask--;
+    for (size_t h = 0; h <= mask; h++) {
+        pt->slot[h] = -1;
     }
 
-    if (cd->readed == 0) {
-        cmp_uf_union(cd, f1_idx, f2_idx);
-        return 0;
+    int classes = 0;
+    int failed = 0;
+    for (size_t i = 0; i < size; i++) {
+        int idx = cd->order[sidx + i];
+        if (cd->file[idx] == NULL || cd->file[idx]->_errno != 0) {
+            pt->file_cls[i] = -1;
+            failed++;
+            continue;
+        }
+        size_t len = cd->block_len[idx];
+        uint64_t fp = block_fingerprint(cd->block[idx], len);
+        size_t h = (size_t) fp_mix(fp, 0) & mask;
+        while (pt->slot[h] != -1 && pt->cls_fp[pt->slot[h]] != fp) {
+            h = (h + 1) & mask;
+        }
+        int c = -1;
+        int last = -1;
+        for (int k = pt->slot[h]; k != -1; k = pt->cls_next[k]) {
+            int rep = pt->cls_rep[k];
+            if (cd->block_len[rep] == len && blk_mismatch(cd->block[rep], cd->block[idx], len) == len) {
+                c = k;
+                break;
+            }
+            last = k;
+        }
+        if (c == -1) {
+            c = classes++;
+            pt->cls_fp[c] = fp;
+            pt->cls_rep[c] = idx;
+            pt->cls_next[c] = -1;
+            pt->cls_start[c] = 0;
+            if (last == -1) {
+                pt->slot[h] = c;
+            } else {
+                pt->cls_next[last] = c;
+            }
+        }
+        pt->file_cls[i] = c;
+        pt->cls_start[c]++;
     }
 
-    int cmp = memcmp(cd->data[f1_idx], cd->data[f2_idx], cd->readed);
+    int start = failed;
+    for (int c = 0; c < classes; c++) {
+        int n = pt->cls_start[c];
+        pt->cls_start[c] = start;
+        start += n;
+    }
+    int next_failed = 0;
+    for (size_t i = 0; i < size; i++) {
+        int idx = cd->order[sidx + i];
+        if (pt->file_cls[i] == -1) {
+            pt->tmp[next_failed++] = idx;
+        } else {
+            pt->tmp[pt->cls_start[pt->file_cls[i]]++] = idx;
+        }
+    }
+    memcpy(&cd->order[sidx], pt->tmp, sizeof(int) * size);
 
-    if (cmp == 0) {
-        cmp_uf_union(cd, f1_idx, f2_idx);
-    } else {
-        cmp_uf_diff(cd, f1_idx, f2_idx);
+    // cls_start now holds the end of each class
+    int cur = sidx;
+    for (int i = 1; i <= failed && i < (int) size; i++) {
+        cmp_range_split(cd, cur, sidx + i);
+        cur = sidx + i;
+    }
+    for (int c = 0; c < classes - 1; c++) {
+        cmp_range_split(cd, cur, sidx + pt->cls_start[c]);
+        cur = sidx + pt->cls_start[c];
     }
-    return cmp;
 }
 
 ComparisonResult*
@@ -224,6 +360,9 @@ void free_comparison_result(ComparisonResult *result) {
                 }
                 free(result->sets[i].paths);
             }
+            if (result->sets[i].indices) {
+                free(result->sets[i].indices);
+            }
         }
         free(result->sets);
     }
@@ -241,6 +380,34 @@ void free_error_message(char *error_message) {
     }
 }
 
+void
+init_compare_options(CompareOptions *options) {
+    options->max_buffer = 8192;
+    options->max_open_files = fm_default_limit();
+    options->engine = COMPARE_ENGINE_READ;
+    options->probe_tail = 0;
+    options->probe_samples = 0;
+    options->readahead = 1;
+    options->threads = 1;
+    options->seek_order = -1;
+    options->shared_extents = -1;
+    options->cache_probe = 1;
+    options->cache_neutral = 0;
+}
+
+size_t
+compare_group_buffer(const CompareOptions *options, size_t group_size, int workers) {
+    size_t budget = options->max_buffer > 0 ? (size_t) options->max_buffer : 0;
+    size_t share = budget / (size_t) (workers > 1 ? workers : 1);
+    if (share < group_size * MIN_BUFFER_PER_FILE) {
+        share = group_size * MIN_BUFFER_PER_FILE;
+    }
+    if (share > budget) {
+        share = budget;
+    }
+    return group_size * BLOCK_MAX < share ? group_size * BLOCK_MAX : share;
+}
+
 int compare_files_async(
     char *file_paths[],
     int count,
@@ -250,6 +417,1348 @@ int compare_files_async(
     void *user_data,
     char **error_message_out) {
 
+    CompareOptions options;
+    init_compare_options(&options);
+    options.max_buffer = max_buffer_per_file;
+    options.max_open_files = max_open_files;
+    return compare_files_async_opts(file_paths, count, &options, callback, user_data, error_message_out);
+}
+
+/**
+ * Walk the ranges a group was split into. Ranges of several files are kept for
+ * the next pass when there is more data to compare. A file alone in its range
+ * is retired at once: it is closed (or unmapped) so that its descriptor slot
+ * goes to the files still compared, and no later pass visits it.
+ * @param more data was read in this pass, the files did not end yet
+ */
+static void
+keep_ranges(fmanage *fm, cmpdata *cd, int sidx, int end, int more) {
+    for (int s = sidx; s < end; s = cd->range_end[s]) {
+        if (cd->range_end[s] - s > 1) {
+            if (more) {
+                cmp_range_keep(cd, s);
+            }
+            continue;
+        }
+        int idx = cd->order[s];
+        if (cd->file[idx] != NULL) {
+            fm_fclose(fm, cd->file[idx]);
+            cd->file[idx] = NULL;
+        }
+    }
+}
+
+#define PROBE_MIN_FILE_SIZE (64 * 1024)
+#define PROBE_KEY 8         // file size stored big-endian in front of the probed bytes
+#define CACHE_PROBE_SAMPLES 7   // middle blocks looked up in the page cache besides the tail
+
+// Ranges read by the probe stage, the forward sweep skips them
+typedef struct {
+    int max_ranges;     // ranges per file: middle samples and the tail
+    size_t probe_size;
+    off_t *start;       // ascending range starts of file i at start[i * max_ranges]
+    int *count;         // number of ranges of file i
+    int *slot;          // range compared in each round: 0 the tail, s > 0 the middle sample s - 1
+    int cached_only;    // keep only the ranges cached for every file (cache probe)
+} probe_plan;
+
+/**
+ * Probed ranges of a file: samples evenly spread middle blocks and the tail block.
+ * Small files are not probed, the sweep reads them in a few blocks anyway.
+ * @return number of ranges stored in start (ascending, the tail is the last one)
+ */
+static int
+probe_ranges(off_t size, int samples, size_t probe_size, off_t *start) {
+    if (size < PROBE_MIN_FILE_SIZE || size < (off_t) probe_size * (samples + 2)) {
+        return 0;
+    }
+    off_t tail = size - (off_t) probe_size;
+    off_t end = (off_t) probe_size;
+    int n = 0;
+    for (int k = 1; k <= samples; k++) {
+        off_t off = size / (samples + 1) * k;
+        off -= off % (off_t) probe_size;
+        if (off >= end && off + (off_t) probe_size <= tail) {
+            start[n++] = off;
+            end = off + (off_t) probe_size;
+        }
+    }
+    start[n++] = tail;
+    return n;
+}
+
+/**
+ * Move the position of a file past probed ranges it reached and shorten the
+ * block so that it ends before the next probed range.
+ * @return block size to read
+ */
+static size_t
+probe_skip(const probe_plan *plan, int idx, fm_FILE *ff, size_t block) {
+    if (plan == NULL) {
+        return block;
+    }
+    const off_t *start = plan->start + (size_t) idx * plan->max_ranges;
+    for (int r = 0; r < plan->count[idx]; r++) {
+        off_t end = start[r] + (off_t) plan->probe_size;
+        if (ff->pos >= end) {
+            continue;
+        }
+        if (ff->pos >= start[r]) {
+            ff->pos = end;
+            continue;
+        }
+        if ((off_t) block > start[r] - ff->pos) {
+            block = (size_t) (start[r] - ff->pos);
+        }
+        break;
+    }
+    return block;
+}
+
+/**
+ * Order the probe rounds by the page cache: ranges cached for every file of
+ * the group are compared without disk reads, so they go first and split the
+ * group before cold ranges are read. The cache probe drops the other ranges,
+ * the forward sweep reads them.
+ * @return number of probe rounds
+ */
+static int
+probe_order(fmanage *fm, cmpdata *cd, int count, probe_plan *plan) {
+    for (int s = 0; s < plan->max_ranges; s++) {
+        plan->slot[s] = s;
+    }
+    // Ranges are aligned across files of one size only
+    int n = -1;
+    for (int i = 0; i < count; i++) {
+        if (cd->file[i] != NULL && cd->file[i]->_errno == 0) {
+            n = n < 0 || n == plan->count[i] ? plan->count[i] : 0;
+        }
+    }
+    // A cold group is told by its first file: nothing of it cached, no range is cached for all
+    if (plan->cached_only && n > 0) {
+        for (int i = 0; i < count; i++) {
+            if (cd->file[i] != NULL && cd->file[i]->_errno == 0) {
+                n = fm_cached_any(fm, cd->file[i]) ? n : 0;
+                break;
+            }
+        }
+    }
+    int *cached = n > 0 ? (int *) salloc(sizeof(int) * n, NULL) : NULL;
+    int cached_count = 0;
+    for (int r = 0; cached != NULL && r < n; r++) {
+        cached[r] = 1;
+        for (int i = 0; i < count && cached[r]; i++) {
+            if (cd->file[i] != NULL && cd->file[i]->_errno == 0) {
+                cached[r] = fm_resident(fm, cd->file[i], plan->start[(size_t) i * plan->max_ranges + r],
+                                        plan->probe_size);
+            }
+        }
+        cached_count += cached[r];
+    }
+
+    if (plan->cached_only) {
+        for (int i = 0; i < count; i++) {
+            off_t *start = plan->start + (size_t) i * plan->max_ranges;
+            int kept = 0;
+            for (int r = 0; r < plan->count[i] && cached != NULL; r++) {
+                if (cached[r]) {
+                    start[kept++] = start[r];
+                }
+            }
+            plan->count[i] = kept;
+        }
+    } else if (cached_count > 0) {
+        int rounds = 0;
+        for (int pick = 1; pick >= 0; pick--) {
+            for (int s = 0; s < plan->max_ranges; s++) {
+                int r = s == 0 ? n - 1 : s - 1;
+                if ((r < n && cached[r]) == pick) {
+                    plan->slot[rounds++] = s;
+                }
+            }
+        }
+    }
+    free(cached);
+    return plan->cached_only ? cached_count : plan->max_ranges;
+}
+
+/**
+ * Probe stage: split the files on their sizes and on the tail block, then on
+ * each middle sample, before the forward sweep starts. Every probe round works
+ * like a pass: the blocks of a group are read and the group is split.
+ * Files that cannot be opened are left for the sweep to report.
+ * @param buf buffer of count * cd->buffer_size bytes
+ */
+static void
+probe_files(fmanage *fm, cmpdata *cd, partitioner *pt, char *file_paths[], int count, probe_plan *plan,
+            char *buf) {
+    for (int i = 0; i < count; i++) {
+        if (cd->file[i] == NULL) {
+            cd->file[i] = fm_fopen(fm, file_paths[i]);
+        }
+        plan->count[i] = 0;
+        if (cd->file[i] != NULL && cd->file[i]->_errno == 0) {
+            plan->count[i] = probe_ranges(cd->file[i]->size, plan->max_ranges - 1, plan->probe_size,
+                                          plan->start + (size_t) i * plan->max_ranges);
+        }
+    }
+    int rounds = probe_order(fm, cd, count, plan);
+    for (int round = 0; round < rounds; round++) {
+        int slot = plan->slot[round];
+        for (int l = 0; l < cd->live_count; l++) {
+            int sidx = cd->live[l];
+            int end = cd->range_end[sidx];
+            size_t group_size = end - sidx;
+            if (group_size > 1) {
+                for (size_t j = 0; j < group_size; j++) {
+                    int idx = cd->order[sidx + j];
+                    fm_FILE *ff = cd->file[idx];
+                    unsigned char *dst = (unsigned char *) buf + j * cd->buffer_size;
+                    uint64_t size = ff != NULL && ff->size > 0 ? (uint64_t) ff->size : 0;
+                    for (int b = 0; b < PROBE_KEY; b++) {
+                        dst[b] = (unsigned char) (size >> (8 * (PROBE_KEY - 1 - b)));
+                    }
+
+                    // The tail goes first, then the middle samples from the start of the file
+                    int n = plan->count[idx];
+                    int r = slot == 0 ? n - 1 : slot - 1;
+                    size_t cnt = 0;
+                    if (ff != NULL && n > 0 && (slot == 0 || r < n - 1)) {
+                        cnt = fm_pread_at(fm, ff, dst + PROBE_KEY, plan->probe_size,
+                                          plan->start[(size_t) idx * plan->max_ranges + r]);
+                    }
+                    memset(dst + PROBE_KEY + cnt, 0, plan->probe_size - cnt);
+                    cd->block[idx] = (const char *) dst;
+                    cd->block_len[idx] = PROBE_KEY + plan->probe_size;
+                }
+                partition_group(pt, cd, sidx, group_size);
+                keep_ranges(fm, cd, sidx, end, 1);
+            }
+        }
+        cmp_range_next_pass(cd);
+    }
+}
+
+#define BATCH_RING_ENTRIES 256
+#define BATCH_NOT_READ (-1)
+
+// Batched reads of one comparison run (uring engine)
+typedef struct {
+    fring ring;
+    fr_read *reads;
+    int *owner;         // file index of each read
+    ssize_t *res;       // bytes read per file index, BATCH_NOT_READ if the file was not part of the batch
+} batch_reader;
+
+/**
+ * Read the next block of every file of the sorted group range as batches of
+ * at most fm->limit files, so the files of one batch are never evicted from
+ * each other. The results are stored in br->res for the per-file loop.
+ */
+static void
+batch_read_group(batch_reader *br, fmanage *fm, cmpdata *cd, char *file_paths[], int sidx, size_t size, size_t block,
+                 const probe_plan *plan) {
+    size_t chunk = br->ring.entries < (unsigned) fm->limit ? br->ring.entries : (size_t) fm->limit;
+
+    for (size_t start = 0; start < size; start += chunk) {
+        size_t end = start + chunk < size ? start + chunk : size;
+        int n = 0;
+        for (size_t i = start; i < end; i++) {
+            int idx = cd->order[sidx + i];
+            br->res[idx] = BATCH_NOT_READ;
+            if (cd->file[idx] == NULL) {
+                // Open errors are reported by the per-file loop
+                cd->file[idx] = fm_fopen(fm, file_paths[idx]);
+                if (cd->file[idx] == NULL) {
+                    continue;
+                }
+            }
+            int fd = fm_fileno(fm, cd->file[idx]);
+            if (fd < 0) {
+                continue;
+            }
+            size_t len = probe_skip(plan, idx, cd->file[idx], block);
+            br->owner[n] = idx;
+            fr_read *r = &br->reads[n++];
+            r->fd = fd;
+            r->buf = cd->arena + i * block;
+            r->len = len;
+            r->off = cd->file[idx]->pos;
+            r->buf_index = 0;
+        }
+
+        fr_read_batch(&br->ring, br->reads, n);
+        for (int i = 0; i < n; i++) {
+            fr_read *r = &br->reads[i];
+            int idx = br->owner[i];
+            fm_FILE *ff = cd->file[idx];
+            if (r->res < 0) {
+                ff->_errno = (int) -r->res;
+                br->res[idx] = 0;
+            } else {
+                fm_advance(fm, ff, (size_t) r->res);
+                br->res[idx] = r->res;
+            }
+        }
+    }
+}
+
+/**
+ * Keep the first error of a comparison as "<what> '<path>': <strerror>".
+ */
+static void
+record_error(int *code, char **message, const char *what, const char *path, int errnum) {
+    if (*code != 0) {
+        return;
+    }
+    *code = errnum;
+    char err_buf[256];
+    free(*message);
+    if (snprintf(err_buf, sizeof(err_buf), "%s '%s': %s", what, path, strerror(errnum)) > 0) {
+        *message = sstrdup(err_buf, NULL);
+    } else {
+        *message = sstrdup("File error (error message formatting failed).", NULL);
+    }
+    if (*message == NULL) {
+        *code = ENOMEM;
+    }
+}
+
+/**
+ * Compare the probed ranges of two files of the same size, the tail first.
+ * @param buf two buffers of probe_size bytes
+ * @return 1 if all probed ranges are equal, 0 if not or on error
+ */
+static int
+pair_probe(fmanage *fm, fm_FILE *f1, fm_FILE *f2, int samples, size_t probe_size, off_t *start, char *buf) {
+    int n = probe_ranges(f1->size, samples, probe_size, start);
+    for (int k = 0; k < n; k++) {
+        off_t off = start[(k + n - 1) % n];
+        size_t n1 = fm_pread_at(fm, f1, buf, probe_size, off);
+        size_t n2 = fm_pread_at(fm, f2, buf + probe_size, probe_size, off);
+        if (n1 != n2 || blk_mismatch(buf, buf + probe_size, n1) != n1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define EXTENT_MAP_MAX 64    // extents of a file compared by address at most
+
+/**
+ * Whether two extent maps of n extents are the same.
+ */
+static int
+extents_equal(const fm_extent *e1, const fm_extent *e2, int n) {
+    for (int i = 0; i < n; i++) {
+        if (e1[i].logical != e2[i].logical || e1[i].physical != e2[i].physical || e1[i].length != e2[i].length) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Ranges two files store at the same place of the same filesystem, which hold
+ * the same bytes without reading them.
+ * @param ext scratch of 2 * EXTENT_MAP_MAX extents
+ * @param skip output, up to 2 * EXTENT_MAP_MAX ranges ordered by offset
+ * @return number of ranges, -1 if the files share all their extents
+ */
+static int
+shared_ranges(fmanage *fm, fm_FILE *f1, fm_FILE *f2, fm_extent *ext, fm_extent *skip) {
+    uint64_t fs1;
+    uint64_t fs2;
+    fm_extent *e1 = ext;
+    fm_extent *e2 = ext + EXTENT_MAP_MAX;
+    int n1 = fm_extent_map(fm, f1, &fs1, e1, EXTENT_MAP_MAX);
+    int n2 = n1 > 0 ? fm_extent_map(fm, f2, &fs2, e2, EXTENT_MAP_MAX) : -1;
+    if (n1 <= 0 || n2 <= 0 || fs1 != fs2) {
+        return 0;
+    }
+    if (n1 == n2 && extents_equal(e1, e2, n1)) {
+        return -1;
+    }
+    // Overlapping extents mapping their common range to the same addresses
+    int count = 0;
+    for (int i = 0, j = 0; i < n1 && j < n2;) {
+        off_t start = e1[i].logical > e2[j].logical ? e1[i].logical : e2[j].logical;
+        off_t end1 = e1[i].logical + e1[i].length;
+        off_t end2 = e2[j].logical + e2[j].length;
+        off_t end = end1 < end2 ? end1 : end2;
+        if (start < end && e1[i].physical - (uint64_t) e1[i].logical == e2[j].physical - (uint64_t) e2[j].logical) {
+            if (count > 0 && skip[count - 1].logical + skip[count - 1].length == start) {
+                skip[count - 1].length = end - skip[count - 1].logical;
+            } else {
+                skip[count].logical = start;
+                skip[count].physical = e1[i].physical + (uint64_t) (start - e1[i].logical);
+                skip[count].length = end - start;
+                count++;
+            }
+        }
+        if (end1 <= end2) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Stream two files side by side until the first mismatch or the end of both.
+ * Blocks start at block and double up to max_block.
+ * @param buf two buffers of max_block bytes, unused for mapped files
+ * @param readahead hint the next blocks before comparing the current ones
+ * @param skip ranges both files share on the device, ordered by offset, not read
+ * @param skip_count number of ranges
+ * @return 1 if the files are equal, 0 if not or on error (_errno of the file is set)
+ */
+static int
+pair_same(fmanage *fm, fm_FILE *f1, fm_FILE *f2, size_t block, size_t max_block, char *buf, int readahead,
+          const fm_extent *skip, int skip_count) {
+    int k = 0;
+    for (;;) {
+        const char *p1 = buf;
+        const char *p2 = buf + max_block;
+        size_t n1;
+        size_t n2;
+        size_t want = block;
+        // A hole in both files reads as zeros in both
+        off_t d1 = fm_next_data(fm, f1);
+        off_t d2 = fm_next_data(fm, f2);
+        off_t hole_end = d1 < d2 ? d1 : d2;
+        if (hole_end > f1->pos && f1->pos == f2->pos) {
+            f1->pos = f2->pos = hole_end;
+            continue;
+        }
+        while (k < skip_count && skip[k].logical + skip[k].length <= f1->pos) {
+            k++;
+        }
+        if (k < skip_count && skip[k].logical <= f1->pos) {
+            f1->pos = f2->pos = skip[k].logical + skip[k].length;
+            continue;
+        }
+        if (k < skip_count && (off_t) want > skip[k].logical - f1->pos) {
+            want = (size_t) (skip[k].logical - f1->pos);
+        }
+        if (fm->use_mmap) {
+            n1 = fm_fmap(fm, f1, want, &p1);
+            n2 = fm_fmap(fm, f2, want, &p2);
+        } else {
+            n1 = fm_fread(fm, buf, 1, want, f1);
+            n2 = fm_fread(fm, buf + max_block, 1, want, f2);
+        }
+        if (f1->_errno != 0 || f2->_errno != 0 || n1 != n2) {
+            return 0;
+        }
+        if (n1 == 0) {
+            return 1;
+        }
+        block = block * 2 < max_block ? block * 2 : max_block;
+        // Past the first block, the next one is fetched while this one is compared
+        if (readahead && f1->pos > (off_t) n1) {
+            fm_willneed(fm, f1, block);
+            fm_willneed(fm, f2, block);
+        }
+        if (blk_mismatch(p1, p2, n1) != n1) {
+            return 0;
+        }
+    }
+}
+
+int
+compare_pairs_async(
+    char *pair_paths[],
+    int pair_count,
+    const CompareOptions *options,
+    DuplicateFoundCallback callback,
+    void *user_data,
+    char **error_message_out) {
+
+    CompareOptions default_options;
+    if (options == NULL) {
+        init_compare_options(&default_options);
+        options = &default_options;
+    }
+    if (error_message_out) {
+        *error_message_out = NULL;
+    }
+    if (pair_count < 0 || (pair_count > 0 && pair_paths == NULL) || options->max_buffer <= 0 || callback == NULL) {
+        if (error_message_out) {
+            *error_message_out = sstrdup("Invalid arguments (NULL pair_paths, pair_count < 0, zero/negative max_buffer, or NULL callback).", NULL);
+            if (*error_message_out == NULL) return ENOMEM;
+        }
+        return EINVAL;
+    }
+    if (pair_count == 0) {
+        return 0;
+    }
+
+    // Same budget rules as cmp_init for a group of two files
+    size_t budget = (size_t) options->max_buffer;
+    int use_mmap = options->engine == COMPARE_ENGINE_MMAP;
+    if (!use_mmap && budget / 2 < MIN_BUFFER_PER_FILE) {
+        if (error_message_out) {
+            *error_message_out = sstrdup("Invalid arguments for comparison data initialization (e.g., buffer size too small).", NULL);
+            if (*error_message_out == NULL) return ENOMEM;
+        }
+        return EINVAL;
+    }
+    size_t first_block = budget / 2 < BLOCK_START ? budget / 2 : BLOCK_START;
+    if (first_block < MIN_BUFFER_PER_FILE) {
+        first_block = MIN_BUFFER_PER_FILE;
+    }
+    size_t max_block = use_mmap || budget / 2 > BLOCK_MAX ? BLOCK_MAX : budget / 2;
+
+    int samples = options->probe_samples > 0 ? options->probe_samples : 0;
+    int probe = options->probe_tail || samples > 0;
+
+    char *local_error_message = NULL;
+    int local_error_code = 0;
+
+    // Reflink copies are checked by their extents before their data
+    int shared = options->shared_extents < 0 ? fm_reflinks(pair_paths[0]) : options->shared_extents;
+    fm_extent *ext = NULL;
+    fm_extent *skip = NULL;
+    if (shared) {
+        ext = (fm_extent *) salloc(sizeof(fm_extent) * 4 * EXTENT_MAP_MAX, NULL);
+        skip = ext != NULL ? ext + 2 * EXTENT_MAP_MAX : NULL;
+    }
+
+    fmanage fm;
+    char *buf = NULL;
+    off_t *probe_start = (off_t *) salloc(sizeof(off_t) * (samples + 1), NULL);
+    if (fm_init(&fm, 2, use_mmap) != 0) {
+        free(ext);
+        free(probe_start);
+        local_error_message = sstrdup("Failed to initialize file manager (ENOMEM).", NULL);
+        if (error_message_out) *error_message_out = local_error_message;
+        else if (local_error_message) free(local_error_message);
+        return ENOMEM;
+    }
+    fm.drop_cache = options->cache_neutral;
+    // Mapped files need buffers only for the probes
+    buf = (char *) salloc(2 * (use_mmap ? first_block : max_block), NULL);
+    if (buf == NULL || probe_start == NULL) {
+        free(buf);
+        free(ext);
+        free(probe_start);
+        fm_free(&fm);
+        local_error_message = sstrdup("Failed to allocate pair buffers (ENOMEM).", NULL);
+        if (error_message_out) *error_message_out = local_error_message;
+        else if (local_error_message) free(local_error_message);
+        return ENOMEM;
+    }
+
+    for (int p = 0; p < pair_count; p++) {
+        fm_FILE *f1 = fm_fopen(&fm, pair_paths[2 * p]);
+        if (f1 == NULL) {
+            record_error(&local_error_code, &local_error_message, "Cannot open file", pair_paths[2 * p], errno);
+        }
+        fm_FILE *f2 = fm_fopen(&fm, pair_paths[2 * p + 1]);
+        if (f2 == NULL) {
+            record_error(&local_error_code, &local_error_message, "Cannot open file", pair_paths[2 * p + 1], errno);
+        }
+
+        int same = 0;
+        if (f1 != NULL && f2 != NULL && f1->_errno == 0 && f2->_errno == 0
+            && (f1->size < 0 || f2->size < 0 || f1->size == f2->size)) {
+            int skip_count = ext != NULL ? shared_ranges(&fm, f1, f2, ext, skip) : 0;
+            same = skip_count < 0
+                   || ((!probe || pair_probe(&fm, f1, f2, samples, first_block, probe_start, buf))
+                       && pair_same(&fm, f1, f2, first_block, max_block, buf, options->readahead, skip, skip_count));
+        }
+        if (f1 != NULL && f1->_errno != 0) {
+            record_error(&local_error_code, &local_error_message, "Error reading file", pair_paths[2 * p], f1->_errno);
+        }
+        if (f2 != NULL && f2->_errno != 0) {
+            record_error(&local_error_code, &local_error_message, "Error reading file", pair_paths[2 * p + 1], f2->_errno);
+        }
+        if (f1 != NULL) fm_fclose(&fm, f1);
+        if (f2 != NULL) fm_fclose(&fm, f2);
+
+        if (same) {
+            int indices[2] = {2 * p, 2 * p + 1};
+            DuplicateSet set;
+            set.paths = &pair_paths[2 * p];
+            set.count = 2;
+            set.indices = indices;
+            callback(&set, user_data);
+        }
+    }
+
+    free(buf);
+    free(ext);
+    free(probe_start);
+    fm_free(&fm);
+
+    if (error_message_out && local_error_message) {
+        *error_message_out = local_error_message;
+    } else if (local_error_message) {
+        free(local_error_message);
+    }
+    return local_error_code;
+}
+
+// One thread walking clusters: its open files, read buffers and partition scratch
+typedef struct {
+    fmanage *fm;
+    partitioner *part;
+    char *arena;            // read buffers of the cluster being read
+    size_t arena_size;
+    batch_reader *batch;    // batched reads (uring engine), NULL to read file by file
+    int seek_order;         // read the files of a cluster in the order of their data on the device
+    int error_code;         // first error met by this walker
+    char *error_message;
+} cmp_walker;
+
+/**
+ * Read the next block of a file of a cluster, opening the file first if
+ * needed, and point cd->block at it. Errors are kept in the walker.
+ * @param dst destination, NULL to map the block in place
+ * @param batched the block of the file was read by batch_read_group
+ * @return number of bytes read, 0 at the end of the file or on error
+ */
+static size_t
+read_file_block(cmp_walker *w, cmpdata *cd, char *file_paths[], int idx, char *dst, size_t block,
+                const probe_plan *plan, int batched) {
+    fmanage *fm = w->fm;
+    cd->block_len[idx] = 0;
+    if (cd->file[idx] == NULL) {
+        cd->file[idx] = fm_fopen(fm, file_paths[idx]);
+        if (cd->file[idx] == NULL) {
+            record_error(&w->error_code, &w->error_message, "Cannot open file", file_paths[idx], errno);
+            return 0;
+        }
+    }
+    fm_FILE *ff = cd->file[idx];
+
+    if (ff->_errno != 0) {
+        record_error(&w->error_code, &w->error_message, "Pre-existing error for file", file_paths[idx], ff->_errno);
+        return 0;
+    }
+
+    size_t len;
+    size_t file_block = probe_skip(plan, idx, ff, block);
+    if (batched && w->batch->res[idx] != BATCH_NOT_READ) {
+        // Batched reads went to the same place of the arena
+        len = (size_t) w->batch->res[idx];
+        cd->block[idx] = dst;
+    } else if (dst == NULL) {
+        len = fm_fmap(fm, ff, file_block, &cd->block[idx]);
+    } else {
+        len = fm_fread(fm, dst, 1, file_block, ff);
+        cd->block[idx] = dst;
+    }
+
+    // Files with a shorter block differ, partition_group compares the lengths too
+    cd->block_len[idx] = len;
+    if (len == 0 && ff->_errno != 0) {
+        record_error(&w->error_code, &w->error_message, "Error reading file", file_paths[idx], ff->_errno);
+    }
+    return len;
+}
+
+#define REP_CLASSES 8   // classes kept by a pass over a cluster larger than the open files limit
+#define SEEK_BLOCK_PASSES 4 // blocks of seek ordered clusters start as large as after this many passes
+
+/**
+ * Order in which the files of a cluster are read in this pass. With seek
+ * ordering the files are sorted by the physical offset of their next read,
+ * every other pass backwards like an elevator, so the disk head sweeps the
+ * cluster once instead of seeking back and forth. Files are opened to get
+ * their offset, so clusters larger than the open files limit keep their order.
+ * @return positions in the cluster, in w->part->reads[].idx
+ */
+static fp_entry *
+order_reads(cmp_walker *w, cmpdata *cd, char *file_paths[], int sidx, size_t group_size, int pass) {
+    fp_entry *reads = w->part->reads;
+    int physical = w->seek_order && group_size <= (size_t) w->fm->limit;
+    for (size_t i = 0; i < group_size; i++) {
+        reads[i].idx = (int) i;
+        reads[i].fp = 0;
+        if (physical) {
+            int idx = cd->order[sidx + i];
+            if (cd->file[idx] == NULL) {
+                // Failures are recorded by read_file_block, which retries the open
+                cd->file[idx] = fm_fopen(w->fm, file_paths[idx]);
+            }
+            reads[i].fp = fm_physical(w->fm, cd->file[idx]);
+        }
+    }
+    if (physical) {
+        qsort(reads, group_size, sizeof(fp_entry), fp_entry_cmp);
+    }
+    if (pass % 2) {
+        for (size_t i = 0; i < group_size / 2; i++) {
+            fp_entry t = reads[i];
+            reads[i] = reads[group_size - 1 - i];
+            reads[group_size - 1 - i] = t;
+        }
+    }
+    return reads;
+}
+
+/**
+ * Pass over a cluster with more files than may be open at once, or than the
+ * buffer holds blocks for. Reading a small block of every file would reopen
+ * nearly every file on every pass, so the files are read one at a time in
+ * blocks sized for REP_CLASSES + 1 files and compared with the blocks of the
+ * classes met so far in the pass. Files matching none of REP_CLASSES classes
+ * are rewound and form one more range, compared among themselves in the next
+ * pass. Every other pass reads the files backwards: the files read last are
+ * still open when the next pass starts.
+ * @return 1 if data was read, 0 if the files ended
+ */
+static int
+compare_range_reps(cmp_walker *w, cmpdata *cd, char *file_paths[], int sidx, int pass, size_t align,
+                   const probe_plan *plan) {
+    partitioner *pt = w->part;
+    size_t group_size = cd->range_end[sidx] - sidx;
+    int block_pass = w->seek_order ? pass + SEEK_BLOCK_PASSES : pass;
+    size_t block = cmp_block_size(cd, block_pass, REP_CLASSES + 1, align, w->arena_size);
+    fp_entry *reads = order_reads(w, cd, file_paths, sidx, group_size, pass);
+    int any_positive_data_read = 0;
+    int classes = 0;
+    int failed = 0;
+    int rest = 0;
+
+    for (size_t k = 0; k < group_size; k++) {
+        size_t i = (size_t) reads[k].idx;
+        int idx = cd->order[sidx + i];
+        // Class c keeps its block in slot c, the next free slot takes the file being read
+        size_t len = read_file_block(w, cd, file_paths, idx, w->arena + (size_t) classes * block, block, plan, 0);
+        fm_FILE *ff = cd->file[idx];
+        if (ff == NULL || ff->_errno != 0) {
+            pt->file_cls[i] = -1;
+            failed++;
+            continue;
+        }
+        int c = 0;
+        while (c < classes && (cd->block_len[pt->cls_rep[c]] != len
+                               || blk_mismatch(cd->block[pt->cls_rep[c]], cd->block[idx], len) != len)) {
+            c++;
+        }
+        if (c == classes) {
+            if (classes == REP_CLASSES) {
+                ff->pos -= (off_t) len;
+                pt->file_cls[i] = REP_CLASSES;
+                rest++;
+                continue;
+            }
+            pt->cls_rep[c] = idx;
+            pt->cls_start[c] = 0;
+            classes++;
+        }
+        pt->file_cls[i] = c;
+        pt->cls_start[c]++;
+        if (len > 0) {
+            any_positive_data_read = 1;
+        }
+    }
+
+    // Failed files first as singletons, then the classes and the rewound files, in their former order
+    pt->cls_start[classes] = rest;
+    int start = failed;
+    for (int c = 0; c <= classes; c++) {
+        int n = pt->cls_start[c];
+        pt->cls_start[c] = start;
+        start += n;
+    }
+    int next_failed = 0;
+    for (size_t i = 0; i < group_size; i++) {
+        int idx = cd->order[sidx + i];
+        int c = pt->file_cls[i] == REP_CLASSES ? classes : pt->file_cls[i];
+        if (c == -1) {
+            pt->tmp[next_failed++] = idx;
+        } else {
+            pt->tmp[pt->cls_start[c]++] = idx;
+        }
+    }
+    memcpy(&cd->order[sidx], pt->tmp, sizeof(int) * group_size);
+
+    int cur = sidx;
+    for (int i = 1; i <= failed && i < (int) group_size; i++) {
+        cmp_range_split(cd, cur, sidx + i);
+        cur = sidx + i;
+    }
+    for (int c = 0; c < classes; c++) {
+        if (sidx + pt->cls_start[c] < sidx + (int) group_size && sidx + pt->cls_start[c] > cur) {
+            cmp_range_split(cd, cur, sidx + pt->cls_start[c]);
+            cur = sidx + pt->cls_start[c];
+        }
+    }
+    return any_positive_data_read;
+}
+
+/**
+ * Move the files of a cluster past a hole all of them have at their position:
+ * the range reads as zeros in every file, so it is equal without reading it.
+ * Files that were not opened yet are not opened for it.
+ */
+static void
+skip_holes(fmanage *fm, cmpdata *cd, int sidx, size_t group_size) {
+    off_t next = -1;
+    for (size_t i = 0; i < group_size; i++) {
+        fm_FILE *ff = cd->file[cd->order[sidx + i]];
+        if (ff == NULL) {
+            return;
+        }
+        off_t data = fm_next_data(fm, ff);
+        if (data <= ff->pos) {
+            return;
+        }
+        if (next < 0 || data < next) {
+            next = data;
+        }
+    }
+    for (size_t i = 0; i < group_size; i++) {
+        cd->file[cd->order[sidx + i]]->pos = next;
+    }
+}
+
+/**
+ * Read the next block of every file of a cluster and split the cluster by
+ * the blocks. Errors are kept in the walker, failed files end up alone.
+ * @param sidx first position of the cluster, it has more than one file
+ * @param pass number of passes the cluster went through
+ * @return 1 if data was read, 0 if the files ended
+ */
+static int
+compare_range(cmp_walker *w, cmpdata *cd, char *file_paths[], int sidx, int pass, const probe_plan *plan,
+              int readahead) {
+    fmanage *fm = w->fm;
+    size_t group_size = cd->range_end[sidx] - sidx;
+    int any_positive_data_read = 0;
+    int in_place = fm->use_mmap && group_size <= (size_t) fm->limit;
+    size_t arena_size = in_place ? 0 : w->arena_size;
+
+    // Align growing blocks to the largest preferred I/O size of the group
+    size_t align = 0;
+    for (size_t i = 0; i < group_size; i++) {
+        fm_FILE *ff = cd->file[cd->order[sidx + i]];
+        if (ff != NULL && ff->blksize > align) {
+            align = ff->blksize;
+        }
+    }
+
+    // Past the first block, where most clusters split, larger clusters keep their files open longer;
+    // clusters left by the hashes of a large group may not even fit the buffer at its smallest blocks
+    if (w->arena != NULL && ((pass > 0 && group_size > (size_t) fm->limit && group_size > REP_CLASSES + 1)
+                             || group_size * MIN_BUFFER_PER_FILE > w->arena_size)) {
+        return compare_range_reps(w, cd, file_paths, sidx, pass, align, plan);
+    }
+
+    // Asking for holes reopens closed files, clusters larger than the open files limit are read through
+    if (group_size <= (size_t) fm->limit) {
+        skip_holes(fm, cd, sidx, group_size);
+    }
+
+    // Seek ordered clusters are read in larger blocks, fewer passes amortize the seeks between the files
+    int block_pass = w->seek_order ? pass + SEEK_BLOCK_PASSES : pass;
+    size_t block = cmp_block_size(cd, block_pass, group_size, align, arena_size);
+
+    fp_entry *reads = NULL;
+    if (w->batch != NULL) {
+        batch_read_group(w->batch, fm, cd, file_paths, sidx, group_size, block, plan);
+    } else if (w->seek_order && !fm->use_mmap) {
+        reads = order_reads(w, cd, file_paths, sidx, group_size, pass);
+    }
+
+    for (size_t k = 0; k < group_size; k++) {
+        size_t i = reads != NULL ? (size_t) reads[k].idx : k;
+        int idx = cd->order[sidx + i];
+        if (read_file_block(w, cd, file_paths, idx, in_place ? NULL : w->arena + i * block, block, plan,
+                            w->batch != NULL) > 0) {
+            any_positive_data_read = 1;
+        }
+    }
+
+    // A group that stayed together for a pass likely survives the next block too,
+    // its reads start now and overlap with the partition and the other groups
+    if (readahead && pass > 0 && any_positive_data_read) {
+        size_t next_block = cmp_block_size(cd, block_pass + 1, group_size, align, arena_size);
+        for (size_t i = 0; i < group_size; i++) {
+            fm_willneed(fm, cd->file[cd->order[sidx + i]], next_block);
+        }
+    }
+
+    partition_group(w->part, cd, sidx, group_size);
+    return any_positive_data_read;
+}
+
+// Clusters of a group compared by a pool of walkers
+typedef struct {
+    cmpdata *cd;
+    char **file_paths;
+    const probe_plan *plan;
+    int readahead;
+    cmp_walker *walkers;    // one per worker
+    int *pass;              // passes done by the cluster starting at each position, tasks point here
+} range_pool;
+
+/**
+ * Compare a cluster to its end. Used as wspool task handler. The task goes on
+ * with the first part of a split cluster and submits the other parts, whose
+ * files are released first: a task may be stolen by another worker, and every
+ * worker reopens files in its own file manager.
+ */
+static void
+run_range(wspool *pool, int worker, void *task, void *ctx) {
+    range_pool *rp = (range_pool *) ctx;
+    cmp_walker *w = &rp->walkers[worker];
+    cmpdata *cd = rp->cd;
+    int sidx = (int) ((int *) task - rp->pass);
+    int pass = rp->pass[sidx];
+
+    while (sidx >= 0) {
+        int end = cd->range_end[sidx];
+        int more = compare_range(w, cd, rp->file_paths, sidx, pass, rp->plan, rp->readahead);
+        pass++;
+        int next = -1;
+        // The end of a part is taken before the part is submitted and split by another worker
+        for (int s = sidx, s_end; s < end; s = s_end) {
+            s_end = cd->range_end[s];
+            if (s_end - s == 1) {
+                int idx = cd->order[s];
+                if (cd->file[idx] != NULL) {
+                    fm_fclose(w->fm, cd->file[idx]);
+                    cd->file[idx] = NULL;
+                }
+                continue;
+            }
+            if (!more) {
+                continue;
+            }
+            if (next < 0) {
+                next = s;
+                continue;
+            }
+            for (int i = s; i < s_end; i++) {
+                fm_release(w->fm, cd->file[cd->order[i]]);
+            }
+            rp->pass[s] = pass;
+            if (wspool_submit(pool, worker, &rp->pass[s]) != 0) {
+                run_range(pool, worker, &rp->pass[s], ctx);
+            }
+        }
+        sidx = next;
+    }
+}
+
+/**
+ * Compare the live clusters of a group in parallel once it split. Every worker
+ * gets its own file manager holding its share of the open files limit, its
+ * share of the buffer and its partition scratch. The number of workers is
+ * lowered until the largest cluster fits a share and every share holds two files.
+ * @param main_w walker of the serial passes, its files are handed over and errors merged into it
+ * @param pass number of passes done so far
+ * @return 1 if the clusters were compared to their end, 0 if the serial passes go on
+ */
+static int
+compare_ranges_parallel(cmp_walker *main_w, cmpdata *cd, char *file_paths[], int pass, const probe_plan *plan,
+                        const CompareOptions *options) {
+    size_t max_range = 0;
+    for (int l = 0; l < cd->live_count; l++) {
+        size_t n = cd->range_end[cd->live[l]] - cd->live[l];
+        if (n > max_range) {
+            max_range = n;
+        }
+    }
+    int workers = options->threads;
+    if (workers > main_w->fm->limit / 2) {
+        workers = main_w->fm->limit / 2;
+    }
+    if ((size_t) workers > cd->budget / (max_range * MIN_BUFFER_PER_FILE)) {
+        workers = (int) (cd->budget / (max_range * MIN_BUFFER_PER_FILE));
+    }
+    if (workers < 2) {
+        return 0;
+    }
+
+    // Workers read into slices of the arena, mapped groups get one now
+    if (cd->arena == NULL) {
+        cd->arena = (char *) salloc(cd->budget, NULL);
+        if (cd->arena == NULL) {
+            return 0;
+        }
+        cd->arena_size = cd->budget;
+    }
+    size_t share = cd->arena_size / (size_t) workers;
+
+    range_pool rp;
+    rp.cd = cd;
+    rp.file_paths = file_paths;
+    rp.plan = plan;
+    rp.readahead = options->readahead;
+    rp.pass = (int *) salloc(sizeof(int) * cd->size, NULL);
+    rp.walkers = (cmp_walker *) salloc(sizeof(cmp_walker) * workers, NULL);
+    fmanage *fms = (fmanage *) salloc(sizeof(fmanage) * workers, NULL);
+    partitioner *parts = (partitioner *) salloc(sizeof(partitioner) * workers, NULL);
+    int ready = 0;
+    int ret = rp.pass != NULL && rp.walkers != NULL && fms != NULL && parts != NULL ? 0 : ENOMEM;
+    for (; ret == 0 && ready < workers; ready++) {
+        cmp_walker *w = &rp.walkers[ready];
+        w->fm = &fms[ready];
+        w->part = &parts[ready];
+        w->arena = cd->arena + (size_t) ready * share;
+        w->arena_size = share;
+        w->batch = NULL;
+        w->seek_order = main_w->seek_order;
+        w->error_code = 0;
+        w->error_message = NULL;
+        ret = fm_init(w->fm, main_w->fm->limit / workers, main_w->fm->use_mmap);
+        w->fm->drop_cache = main_w->fm->drop_cache;
+        if (ret == 0 && part_init(w->part, (int) max_range) != 0) {
+            part_free(w->part);
+            fm_free(w->fm);
+            ret = ENOMEM;
+        }
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    wspool pool;
+    if (ret == 0) {
+        ret = wspool_init(&pool, workers, run_range, &rp);
+    }
+    if (ret == 0) {
+        for (int l = 0; l < cd->live_count && ret == 0; l++) {
+            int sidx = cd->live[l];
+            for (int i = sidx; i < cd->range_end[sidx]; i++) {
+                fm_release(main_w->fm, cd->file[cd->order[i]]);
+            }
+            rp.pass[sidx] = pass;
+            ret = wspool_submit(&pool, l % workers, &rp.pass[sidx]);
+        }
+        if (ret == 0) {
+            // Threads that failed to start leave their work to the others
+            wspool_run(&pool);
+            cd->live_count = 0;
+        }
+        wspool_free(&pool);
+    }
+
+    for (int k = 0; k < ready; k++) {
+        cmp_walker *w = &rp.walkers[k];
+        if (w->error_code != 0 && main_w->error_code == 0) {
+            main_w->error_code = w->error_code;
+            main_w->error_message = w->error_message;
+        } else {
+            free(w->error_message);
+        }
+        // Files still open are closed, the fm_FILE structures stay in cd
+        fm_free(w->fm);
+        part_free(w->part);
+    }
+    free(parts);
+    free(fms);
+    free(rp.walkers);
+    free(rp.pass);
+    return ret == 0;
+}
+
+/**
+ * Hash of a whole block, unlike block_fingerprint every word is mixed in:
+ * files of a large group are not compared with each other block by block.
+ */
+static uint64_t
+block_hash(const char *block, size_t n) {
+    uint64_t h = n;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, block + i, sizeof(w));
+        h = fp_mix(h, w);
+    }
+    for (; i < n; i++) {
+        h = fp_mix(h, (unsigned char) block[i]);
+    }
+    return h;
+}
+
+/**
+ * Split a cluster too large for the buffer by hashes of one block of every
+ * file, reading one file at a time. Buckets whose files fit the buffer, and
+ * buckets hashed equal down to the end of their files, are kept as clusters
+ * for the passes, which compare them with representatives like any cluster.
+ * Larger buckets are hashed again on the next block, twice as large. Files
+ * alone in their bucket, and files that failed, end up alone in their range.
+ * @param sidx first position of the cluster
+ * @param off offset of the block hashed at this level
+ * @param block block size, buf holds max_block bytes
+ * @param max_group largest cluster whose files fit the buffer
+ */
+static void
+split_large_group(cmp_walker *w, cmpdata *cd, char *file_paths[], int sidx, off_t off, size_t block,
+                  size_t max_block, char *buf, int max_group) {
+    partitioner *pt = w->part;
+    int end = cd->range_end[sidx];
+    // Entries sit at the positions of the cluster, a bucket is split again in its own slice
+    fp_entry *entries = pt->reads + sidx;
+    int hashed = 0;
+    int failed = 0;
+    for (int i = sidx; i < end; i++) {
+        int idx = cd->order[i];
+        fm_FILE *ff = fm_fopen(w->fm, file_paths[idx]);
+        if (ff == NULL) {
+            record_error(&w->error_code, &w->error_message, "Cannot open file", file_paths[idx], errno);
+            pt->tmp[failed++] = idx;
+            continue;
+        }
+        size_t len = fm_pread_at(w->fm, ff, buf, block, off);
+        if (ff->_errno != 0) {
+            record_error(&w->error_code, &w->error_message, "Error reading file", file_paths[idx], ff->_errno);
+            pt->tmp[failed++] = idx;
+        } else {
+            entries[hashed].fp = block_hash(buf, len);
+            entries[hashed].idx = idx;
+            entries[hashed++].ended = len < block;
+        }
+        fm_fclose(w->fm, ff);
+    }
+    qsort(entries, hashed, sizeof(fp_entry), fp_entry_cmp);
+
+    // Buckets in hash order, then the failed files
+    for (int i = 0; i < hashed; i++) {
+        cd->order[sidx + i] = entries[i].idx;
+    }
+    memcpy(&cd->order[sidx + hashed], pt->tmp, sizeof(int) * failed);
+    if (hashed > 0 && hashed < end - sidx) {
+        cmp_range_split(cd, sidx, sidx + hashed);
+    }
+    for (int s = sidx + hashed; s + 1 < end; s++) {
+        cmp_range_split(cd, s, s + 1);
+    }
+
+    for (int start = 0, stop; start < hashed; start = stop) {
+        for (stop = start + 1; stop < hashed && entries[stop].fp == entries[start].fp; stop++) {
+        }
+        int ended = entries[start].ended;
+        if (stop < hashed) {
+            cmp_range_split(cd, sidx + start, sidx + stop);
+        }
+        if (stop - start < 2) {
+            continue;
+        }
+        if (stop - start <= max_group || ended) {
+            // Equal hashes down to the end of the files, the hash of a block includes its length
+            cmp_range_keep(cd, sidx + start);
+        } else {
+            split_large_group(w, cd, file_paths, sidx + start, off + (off_t) block,
+                              block * 2 < max_block ? block * 2 : max_block, max_block, buf, max_group);
+        }
+    }
+}
+
+// Sets of the files compared for a group whose files share extents
+typedef struct {
+    DuplicateFoundCallback callback;
+    void *user_data;
+    char **file_paths;
+    const int *reps;        // position in file_paths of each compared file
+    const int *next_link;   // next position sharing the extents of a file, -1 terminates
+    char *reported;         // whether a compared file was reported as part of a set
+    char **paths;           // set being reported
+    int *indices;
+} extent_context;
+
+/**
+ * Report a set of compared files along with the files sharing their extents.
+ */
+static void
+extent_callback(const DuplicateSet *duplicates, void *user_data) {
+    extent_context *ec = (extent_context *) user_data;
+    DuplicateSet set;
+    set.count = 0;
+    for (int i = 0; i < duplicates->count; i++) {
+        int rep = duplicates->indices[i];
+        for (int pos = ec->reps[rep]; pos >= 0; pos = ec->next_link[pos]) {
+            ec->paths[set.count] = ec->file_paths[pos];
+            ec->indices[set.count++] = pos;
+        }
+        ec->reported[rep] = 1;
+    }
+    set.paths = ec->paths;
+    set.indices = ec->indices;
+    ec->callback(&set, ec->user_data);
+}
+
+/**
+ * Hash of an extent map and its filesystem.
+ */
+static uint64_t
+extent_hash(uint64_t fs, const fm_extent *ext, int n) {
+    uint64_t h = fp_mix((uint64_t) n, fs);
+    for (int i = 0; i < n; i++) {
+        h = fp_mix(h, (uint64_t) ext[i].logical);
+        h = fp_mix(h, ext[i].physical);
+        h = fp_mix(h, (uint64_t) ext[i].length);
+    }
+    return h;
+}
+
+/**
+ * Compare a group after merging the files that share all their extents, like
+ * reflink copies and files of snapshots: they hold the same data, so one of
+ * them is compared and the others are reported along with it. Files whose
+ * extent map is unknown are compared as usual.
+ * @param options options of the comparison, shared extents are not checked again
+ * @return 0 on success, non-zero on error, see compare_files_async_opts
+ */
+static int
+compare_shared_files(char *file_paths[], int count, const CompareOptions *options, DuplicateFoundCallback callback,
+                     void *user_data, char **error_message_out) {
+    CompareOptions inner = *options;
+    inner.shared_extents = 0;
+
+    fmanage fm;
+    fp_entry *entries = (fp_entry *) salloc(sizeof(fp_entry) * count, NULL);
+    int *first = (int *) salloc(sizeof(int) * count, NULL);      // first extent of each file in store
+    int *extents = (int *) salloc(sizeof(int) * count, NULL);    // number of extents of each file
+    uint64_t *fss = (uint64_t *) salloc(sizeof(uint64_t) * count, NULL);
+    int *next_link = (int *) salloc(sizeof(int) * count, NULL);
+    int *reps = (int *) salloc(sizeof(int) * count, NULL);
+    size_t store_cap = (size_t) count + EXTENT_MAP_MAX;
+    fm_extent *store = (fm_extent *) salloc(sizeof(fm_extent) * store_cap, NULL);
+    if (entries == NULL || first == NULL || extents == NULL || fss == NULL || next_link == NULL || reps == NULL
+        || store == NULL || fm_init(&fm, 1, 0) != 0) {
+        free(entries);
+        free(first);
+        free(extents);
+        free(fss);
+        free(next_link);
+        free(reps);
+        free(store);
+        return compare_files_async_opts(file_paths, count, &inner, callback, user_data, error_message_out);
+    }
+
+    // Errors are left to the comparison, which opens the files again
+    size_t stored = 0;
+    int known = 0;
+    for (int i = 0; i < count; i++) {
+        next_link[i] = -1;
+        extents[i] = -1;
+        if (store_cap - stored < EXTENT_MAP_MAX) {
+            fm_extent *grown = (fm_extent *) realloc(store, sizeof(fm_extent) * store_cap * 2);
+            if (grown == NULL) {
+                continue;
+            }
+            store = grown;
+            store_cap *= 2;
+        }
+        fm_FILE *ff = fm_fopen(&fm, file_paths[i]);
+        if (ff == NULL) {
+            continue;
+        }
+        int n = fm_extent_map(&fm, ff, &fss[i], store + stored, EXTENT_MAP_MAX);
+        fm_fclose(&fm, ff);
+        if (n > 0) {
+            first[i] = (int) stored;
+            extents[i] = n;
+            stored += (size_t) n;
+            entries[known].fp = extent_hash(fss[i], store + first[i], n);
+            entries[known++].idx = i;
+        }
+    }
+    fm_free(&fm);
+    qsort(entries, known, sizeof(fp_entry), fp_entry_cmp);
+
+    // Chain the files of every map in input order, the first one represents the map;
+    // files merged into another one are left with no extents
+    for (int k = 0; k < known; k++) {
+        int a = entries[k].idx;
+        if (extents[a] == 0) {
+            continue;
+        }
+        int last = a;
+        for (int m = k + 1; m < known && entries[m].fp == entries[k].fp; m++) {
+            int b = entries[m].idx;
+            if (extents[b] == extents[a] && fss[b] == fss[a]
+                && extents_equal(store + first[b], store + first[a], extents[a])) {
+                extents[b] = 0;
+                next_link[last] = b;
+                last = b;
+            }
+        }
+    }
+    int reps_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (extents[i] != 0) {
+            reps[reps_count++] = i;
+        }
+    }
+    free(entries);
+    free(first);
+    free(extents);
+    free(fss);
+    free(store);
+
+    int ret;
+    if (reps_count == count) {
+        ret = compare_files_async_opts(file_paths, count, &inner, callback, user_data, error_message_out);
+    } else {
+        extent_context ec;
+        ec.callback = callback;
+        ec.user_data = user_data;
+        ec.file_paths = file_paths;
+        ec.reps = reps;
+        ec.next_link = next_link;
+        ec.reported = (char *) salloc(reps_count, NULL);
+        ec.paths = (char **) salloc(sizeof(char *) * count, NULL);
+        ec.indices = (int *) salloc(sizeof(int) * count, NULL);
+        char **rep_paths = (char **) salloc(sizeof(char *) * reps_count, NULL);
+        if (ec.reported == NULL || ec.paths == NULL || ec.indices == NULL || rep_paths == NULL) {
+            ret = ENOMEM;
+            if (error_message_out) {
+                *error_message_out = sstrdup("Failed to allocate shared extent sets (ENOMEM).", NULL);
+            }
+        } else {
+            memset(ec.reported, 0, reps_count);
+            for (int r = 0; r < reps_count; r++) {
+                rep_paths[r] = file_paths[reps[r]];
+            }
+            ret = compare_files_async_opts(rep_paths, reps_count, &inner, extent_callback, &ec, error_message_out);
+            // Files sharing their extents form a set even if no other file equals them
+            for (int r = 0; r < reps_count; r++) {
+                if (!ec.reported[r] && next_link[reps[r]] >= 0) {
+                    int one[1] = {r};
+                    DuplicateSet set;
+                    set.paths = &rep_paths[r];
+                    set.count = 1;
+                    set.indices = one;
+                    extent_callback(&set, &ec);
+                }
+            }
+        }
+        free(rep_paths);
+        free(ec.reported);
+        free(ec.paths);
+        free(ec.indices);
+    }
+    free(reps);
+    free(next_link);
+    return ret;
+}
+
+int compare_files_async_opts(
+    char *file_paths[],
+    int count,
+    const CompareOptions *options,
+    DuplicateFoundCallback callback,
+    void *user_data,
+    char **error_message_out) {
+
+    CompareOptions default_options;
+    if (options == NULL) {
+        init_compare_options(&default_options);
+        options = &default_options;
+    }
+    int max_buffer_per_file = options->max_buffer;
+    int max_open_files = options->max_open_files;
+
     if (error_message_out) {
         *error_message_out = NULL;
     }
@@ -265,6 +1774,12 @@ int compare_files_async(
     if (count < 2) {
         return 0;
     }
+    if (count > 2 && (options->shared_extents < 0 ? fm_reflinks(file_paths[0]) : options->shared_extents)) {
+        return compare_shared_files(file_paths, count, options, callback, user_data, error_message_out);
+    }
+    if (count == 2) {
+        return compare_pairs_async(file_paths, 1, options, callback, user_data, error_message_out);
+    }
 
     char *local_error_message = NULL;
     int local_error_code = 0;
@@ -277,12 +1792,37 @@ int compare_files_async(
         else if (local_error_message) free(local_error_message);
         return local_error_code;
     }
-    fm_init(fm, max_open_files > 0 ? max_open_files : count);
+    if (fm_init(fm, max_open_files > 0 ? max_open_files : fm_limit_for(count), options->engine == COMPARE_ENGINE_MMAP) != 0) {
+        free(fm);
+        local_error_message = sstrdup("Failed to initialize file manager (ENOMEM).", NULL);
+        local_error_code = ENOMEM;
+        if (error_message_out) *error_message_out = local_error_message;
+        else if (local_error_message) free(local_error_message);
+        return local_error_code;
+    }
+    fm->drop_cache = options->cache_neutral;
+
+    // Mapped blocks are compared in place while all files of a group fit in the mapping
+    // limit, larger groups copy their blocks out to buffers as the read engine does
+    int use_buffers = !fm->use_mmap || count > fm->limit;
+
+    // Too many files for the buffer: split them by hashes of their blocks first, see split_large_group
+    int large = use_buffers && (size_t) max_buffer_per_file / (size_t) count < MIN_BUFFER_PER_FILE
+                && (size_t) max_buffer_per_file / 2 >= MIN_BUFFER_PER_FILE;
 
     cmpdata current_cmp_data;
-    int cmp_init_ret = cmp_init(&current_cmp_data, count, max_buffer_per_file);
+    int cmp_init_ret = cmp_init(&current_cmp_data, count, max_buffer_per_file, use_buffers && !large);
+    if (cmp_init_ret == 0 && large) {
+        // The arena holds the blocks of the clusters the hashes leave, not one block per file
+        current_cmp_data.arena = (char *) salloc(current_cmp_data.budget, NULL);
+        current_cmp_data.arena_size = current_cmp_data.budget;
+        if (current_cmp_data.arena == NULL) {
+            cmp_init_ret = ENOMEM;
+        }
+    }
 
     if (cmp_init_ret != 0) {
+        fm_free(fm);
         free(fm);
         local_error_code = cmp_init_ret;
         if (local_error_code == ENOMEM) {
@@ -298,133 +1838,124 @@ int compare_files_async(
         return local_error_code;
     }
 
-    int overall_data_read_in_pass;
-    do {
-        overall_data_read_in_pass = 0;
-        int current_file_idx_overall = 0;
+    partitioner part;
+    if (part_init(&part, count) != 0) {
+        part_free(&part);
+        cmp_free(&current_cmp_data);
+        fm_free(fm);
+        free(fm);
+        local_error_message = sstrdup("Failed to allocate partition buffers (ENOMEM).", NULL);
+        local_error_code = ENOMEM;
+        if (error_message_out) *error_message_out = local_error_message;
+        else if (local_error_message) free(local_error_message);
+        return local_error_code;
+    }
 
-        while(current_file_idx_overall < count) {
-            int group_start_idx_in_order_array = current_file_idx_overall;
-            size_t group_size = 0;
-            while (current_file_idx_overall < count &&
-                   cmp_uf_ordered_same(&current_cmp_data, group_start_idx_in_order_array, current_file_idx_overall)) {
-                current_file_idx_overall++;
-                group_size++;
+    batch_reader batch;
+    int use_batch = 0;
+    if (options->engine == COMPARE_ENGINE_URING) {
+        unsigned entries = fm->limit < BATCH_RING_ENTRIES ? (unsigned) fm->limit : BATCH_RING_ENTRIES;
+        if (fr_init(&batch.ring, entries) == 0) {
+            batch.reads = (fr_read *) salloc(sizeof(fr_read) * count, NULL);
+            batch.res = (ssize_t *) salloc(sizeof(ssize_t) * count, NULL);
+            batch.owner = (int *) salloc(sizeof(int) * count, NULL);
+            if (batch.reads != NULL && batch.res != NULL && batch.owner != NULL) {
+                use_batch = 1;
+                // The arena is one registered buffer, without it the reads are plain IORING_OP_READ
+                fr_register_buffers(&batch.ring, &current_cmp_data.arena, 1, current_cmp_data.arena_size);
+            } else {
+                free(batch.reads);
+                free(batch.res);
+                free(batch.owner);
+                fr_free(&batch.ring);
             }
+        }
+    }
 
-            if (group_size > 1) {
-                size_t min_positive_read_in_batch = (size_t)-1;
-                int any_positive_data_read = 0;
-
-                for (int i = 0; i < group_size; i++) {
-                    int original_file_index = current_cmp_data.order[group_start_idx_in_order_array + i];
-
-                    if (current_cmp_data.file[original_file_index] == NULL) {
-                        current_cmp_data.file[original_file_index] = fm_fopen(fm, file_paths[original_file_index]);
-                        if (current_cmp_data.file[original_file_index] == NULL) {
-                            if (local_error_code == 0) {
-                                local_error_code = errno;
-                                char err_buf[256];
-                                if (snprintf(err_buf, sizeof(err_buf), "Cannot open file '%s': %s", file_paths[original_file_index], strerror(errno)) > 0) {
-                                    if (local_error_message) free(local_error_message);
-                                    local_error_message = sstrdup(err_buf, NULL);
-                                } else {
-                                    if (local_error_message) free(local_error_message);
-                                    local_error_message = sstrdup("Cannot open file (error message formatting failed).", NULL);
-                                }
-                                if (!local_error_message && local_error_code != 0 && local_error_code != ENOMEM) { /* sstrdup failed, but local_error_code is already errno */ }
-                                else if (!local_error_message) { local_error_code = ENOMEM; }
-                            }
-                            continue;
-                        }
-                    }
+    probe_plan probe;
+    probe_plan *plan = NULL;
+    // Without a requested probe, blocks cached for all files are still compared first;
+    // finding them opens every file, which the first pass does anyway within the limit.
+    // Large groups are not probed, the buffer does not hold a probed block of every file
+    int requested_probe = options->probe_tail || options->probe_samples > 0;
+    int cache_probe = !requested_probe && options->cache_probe && count <= fm->limit;
+    if (!large && (requested_probe || cache_probe)) {
+        int samples = options->probe_samples > 0 ? options->probe_samples : 0;
+        probe.max_ranges = (cache_probe ? CACHE_PROBE_SAMPLES : samples) + 1;
+        probe.probe_size = current_cmp_data.buffer_size - PROBE_KEY;
+        probe.start = (off_t *) salloc(sizeof(off_t) * count * probe.max_ranges, NULL);
+        probe.count = (int *) salloc(sizeof(int) * count, NULL);
+        probe.slot = (int *) salloc(sizeof(int) * probe.max_ranges, NULL);
+        probe.cached_only = cache_probe;
+        // The arena holds count blocks of buffer_size, mapped files need a buffer of their own
+        char *probe_buf = current_cmp_data.arena != NULL ? current_cmp_data.arena
+                          : (char *) salloc(current_cmp_data.buffer_size * count, NULL);
+        if (probe.start != NULL && probe.count != NULL && probe.slot != NULL && probe_buf != NULL) {
+            probe_files(fm, &current_cmp_data, &part, file_paths, count, &probe, probe_buf);
+            plan = &probe;
+        } else {
+            free(probe.start);
+            free(probe.count);
+            free(probe.slot);
+        }
+        if (probe_buf != current_cmp_data.arena) {
+            free(probe_buf);
+        }
+    }
 
-                    if (current_cmp_data.file[original_file_index]->_errno == 0) {
-                         size_t bytes_read_this_file = fm_fread(fm, current_cmp_data.data[original_file_index], 1,
-                                                                current_cmp_data.buffer_size, current_cmp_data.file[original_file_index]);
-
-                        if (bytes_read_this_file > 0) {
-                            any_positive_data_read = 1;
-                            if (bytes_read_this_file < min_positive_read_in_batch) {
-                                min_positive_read_in_batch = bytes_read_this_file;
-                            }
-                        } else {
-                            if (current_cmp_data.file[original_file_index]->_errno != 0) {
-                                if (local_error_code == 0) {
-                                    local_error_code = current_cmp_data.file[original_file_index]->_errno;
-                                     char err_buf[256];
-                                     if (snprintf(err_buf, sizeof(err_buf), "Error reading file '%s': %s", file_paths[original_file_index], strerror(local_error_code)) > 0) {
-                                        if (local_error_message) free(local_error_message);
-                                        local_error_message = sstrdup(err_buf, NULL);
-                                    } else {
-                                        if (local_error_message) free(local_error_message);
-                                        local_error_message = sstrdup("Error reading file (error message formatting failed).", NULL);
-                                    }
-                                     if (!local_error_message && local_error_code != 0 && local_error_code != ENOMEM) { /* sstrdup failed */ }
-                                     else if (!local_error_message) { local_error_code = ENOMEM; }
-                                }
-                            }
-                        }
-                    } else {
-                        if (local_error_code == 0 && current_cmp_data.file[original_file_index] != NULL ) {
-                           // Capture pre-existing error if no other error has been captured yet.
-                           local_error_code = current_cmp_data.file[original_file_index]->_errno;
-                           char err_buf[256];
-                           if (snprintf(err_buf, sizeof(err_buf), "Pre-existing error for file '%s': %s", file_paths[original_file_index], strerror(local_error_code)) > 0) {
-                               if (local_error_message) free(local_error_message);
-                               local_error_message = sstrdup(err_buf, NULL);
-                           } else {
-                               if (local_error_message) free(local_error_message);
-                               local_error_message = sstrdup("Pre-existing error (msg formatting failed).", NULL);
-                           }
-                           if (!local_error_message && local_error_code != 0 && local_error_code != ENOMEM) { /* sstrdup failed */ }
-                           else if (!local_error_message) { local_error_code = ENOMEM; }
-                        }
-                    }
-                }
+    cmp_walker walker;
+    walker.fm = fm;
+    walker.part = &part;
+    walker.arena = current_cmp_data.arena;
+    walker.arena_size = current_cmp_data.arena_size;
+    walker.batch = use_batch ? &batch : NULL;
+    walker.seek_order = options->seek_order < 0 ? fm_rotational(file_paths[0]) : options->seek_order;
+    walker.error_code = 0;
+    walker.error_message = NULL;
 
-                size_t effective_read_for_batch = 0;
-                if (any_positive_data_read) {
-                    effective_read_for_batch = min_positive_read_in_batch;
-                    overall_data_read_in_pass += effective_read_for_batch;
-                }
-                cmp_uf_reset_ordered(&current_cmp_data, group_start_idx_in_order_array, group_size);
-                current_cmp_data.readed = effective_read_for_batch;
-
-                if (group_size > 1) {
-                    #if defined(_WIN32) || defined(_WIN64)
-                        // Windows: use qsort_s. The context argument is last, similar to GNU qsort_r.
-                        // errno_t qsort_s(void *base, rsize_t nmemb, rsize_t size, int (*compar)(const void *k1, const void *k2, void *context), void *context);
-                        // We are not checking the errno_t return value for now, to keep it similar to the qsort_r void return.
-                        qsort_s(&current_cmp_data.order[group_start_idx_in_order_array], group_size, sizeof(int), ufsorter, &current_cmp_data);
-                    #elif defined(__APPLE__)
-                        // macOS (BSD variant of qsort_r): context is the 4th argument, compar is the 5th.
-                        qsort_r(&current_cmp_data.order[group_start_idx_in_order_array], group_size, sizeof(int), &current_cmp_data, ufsorter);
-                    #else
-                        // Linux/other (GNU qsort_r): compar is the 4th argument, context is the 5th.
-                        qsort_r(&current_cmp_data.order[group_start_idx_in_order_array], group_size, sizeof(int), ufsorter, &current_cmp_data);
-                    #endif
-                }
-            }
+    if (large) {
+        size_t max_block = current_cmp_data.budget < BLOCK_MAX ? current_cmp_data.budget : BLOCK_MAX;
+        current_cmp_data.live_count = 0;
+        split_large_group(&walker, &current_cmp_data, file_paths, 0, 0,
+                          BLOCK_START < max_block ? BLOCK_START : max_block, max_block, current_cmp_data.arena,
+                          (int) (current_cmp_data.budget / MIN_BUFFER_PER_FILE));
+        cmp_range_next_pass(&current_cmp_data);
+    }
+
+    int pass = 0;
+    while (current_cmp_data.live_count > 0) {
+        // Once the group split, its clusters may be compared by several threads
+        if (options->threads > 1 && current_cmp_data.live_count > 1 &&
+            compare_ranges_parallel(&walker, &current_cmp_data, file_paths, pass, plan, options)) {
+            break;
         }
-    } while (overall_data_read_in_pass > 0);
+        for (int live_idx = 0; live_idx < current_cmp_data.live_count; live_idx++) {
+            int sidx = current_cmp_data.live[live_idx];
+            int end = current_cmp_data.range_end[sidx];
+            int more = compare_range(&walker, &current_cmp_data, file_paths, sidx, pass, plan, options->readahead);
+            keep_ranges(fm, &current_cmp_data, sidx, end, more);
+        }
+        cmp_range_next_pass(&current_cmp_data);
+        pass++;
+    }
+    local_error_code = walker.error_code;
+    local_error_message = walker.error_message;
 
     if (local_error_code == 0) {
         int current_idx_in_order = 0;
         while (current_idx_in_order < count) {
             int group_start_sidx = current_idx_in_order;
-            current_idx_in_order++;
-            while (current_idx_in_order < count &&
-                   cmp_uf_ordered_same(&current_cmp_data, group_start_sidx, current_idx_in_order)) {
-                current_idx_in_order++;
-            }
+            current_idx_in_order = current_cmp_data.range_end[group_start_sidx];
             int num_in_potential_group = current_idx_in_order - group_start_sidx;
 
             if (num_in_potential_group > 1) {
                 DuplicateSet current_set;
                 current_set.paths = (char **)salloc(num_in_potential_group * sizeof(char *), NULL); // Pass NULL
+                current_set.indices = (int *)salloc(num_in_potential_group * sizeof(int), NULL);
 
-                if (!current_set.paths) {
+                if (!current_set.paths || !current_set.indices) {
+                    free(current_set.paths);
+                    free(current_set.indices);
                     if (!local_error_message) local_error_message = sstrdup("Failed to allocate paths for a duplicate set callback.", NULL);
                     if (!local_error_code) local_error_code = ENOMEM;
                     break;
@@ -438,11 +1969,13 @@ int compare_files_async(
                         current_cmp_data.file[original_file_idx]->_errno == 0) {
 
                         current_set.paths[actual_paths_added] = sstrdup(file_paths[original_file_idx], NULL); // Pass NULL
+                        current_set.indices[actual_paths_added] = original_file_idx;
                         if (!current_set.paths[actual_paths_added]) {
                              if (!local_error_message) local_error_message = sstrdup("Failed to sstrdup file path for callback.", NULL);
                              if (!local_error_code) local_error_code = ENOMEM;
                              for(int j=0; j < actual_paths_added; ++j) free(current_set.paths[j]);
                              free(current_set.paths);
+                             free(current_set.indices);
                              current_set.paths = NULL;
                              goto cleanup_after_callback_error;
                         }
@@ -467,6 +2000,7 @@ int compare_files_async(
                     }
                     free(current_set.paths);
                 }
+                free(current_set.indices);
             }
         }
     }
@@ -478,6 +2012,18 @@ cleanup_after_callback_error:;
             current_cmp_data.file[i] = NULL;
         }
     }
+    if (use_batch) {
+        fr_free(&batch.ring);
+        free(batch.reads);
+        free(batch.res);
+        free(batch.owner);
+    }
+    if (plan != NULL) {
+        free(probe.start);
+        free(probe.count);
+        free(probe.slot);
+    }
+    part_free(&part);
     cmp_free(&current_cmp_data);
     fm_free(fm);
     free(fm);
@@ -11,6 +11,7 @@
 typedef struct {
     char **paths;       // Array of file path strings (must be freed by caller via free_comparison_result)
     int count;          // Number of paths in this set
+    int *indices;       // Position of each path in the input array of the comparison call
 } DuplicateSet;
 
 // Represents the overall result of a comparison operation
@@ -49,6 +50,56 @@ void free_comparison_result(ComparisonResult *result);
  */
 void free_error_message(char *error_message);
 
+// Engine used to get file blocks for comparison
+typedef enum {
+    COMPARE_ENGINE_READ = 0,    // Read blocks into per-file buffers (default)
+    COMPARE_ENGINE_MMAP,        // Map files read-only and compare mapped windows in place
+    COMPARE_ENGINE_URING        // Submit the block reads of a whole group as one io_uring batch
+                                // (Linux; falls back to the read engine when unavailable)
+} CompareEngine;
+
+// Tuning of a comparison run, initialize with init_compare_options()
+typedef struct {
+    int max_buffer;         // Maximum memory buffer (bytes) shared by all files of the comparison
+    int max_open_files;     // Maximum number of open files (or mappings); 0 or negative means no limit
+    CompareEngine engine;   // How file data is obtained
+    int probe_tail;         // Compare the last block of the files before reading them from the start
+    int probe_samples;      // Number of evenly spread middle blocks compared after the tail (implies probe_tail)
+    int cache_probe;        // Without probe_tail and probe_samples, compare first the tail and sampled middle blocks
+                            // that are in the page cache for all files of the group, before any disk read
+    int readahead;          // Hint the system to fetch the next block of surviving files while a block is compared
+    int threads;            // Threads comparing the clusters of a group once it split, sharing the buffer and
+                            // open files limits; 1 compares them on the calling thread
+    int seek_order;         // Read the files of a cluster in the order of their data on the disk, with larger
+                            // blocks; 0 off, 1 on, negative when the first file lies on a rotational disk
+    int shared_extents;     // Files sharing all their extents (reflink copies) are identical without reading them,
+                            // pairs skip the ranges they share; 0 off, 1 on, negative on filesystems with reflinks
+    int cache_neutral;      // Leave the page cache as it was: pages read from files none of which was cached are
+                            // dropped behind the reads (posix_fadvise), macOS reads bypass the cache (F_NOCACHE)
+} CompareOptions;
+
+/**
+ * Fill options with defaults (8192 bytes buffer, read engine, only cached blocks probed, readahead on, one
+ * thread, seek ordering on rotational disks, shared extents checked on filesystems with reflinks, page cache
+ * used normally). The open files limit of the process is raised towards its hard limit and half of it, at
+ * most 1024 and at least FOPEN_MAX, is the default number of open files.
+ *
+ * @param options Options to initialize.
+ */
+void init_compare_options(CompareOptions *options);
+
+/**
+ * Buffer for one group when several groups are compared at once and share max_buffer: the
+ * group's blocks stop growing at 2 MiB per file, and it takes at most a worker's share of the
+ * budget unless it needs more (128 bytes per file), so that the other workers can run alongside.
+ *
+ * @param options Options holding the shared max_buffer.
+ * @param group_size Number of files of the group.
+ * @param workers Number of groups compared at once.
+ * @return Value for max_buffer of the group's comparison, at most options->max_buffer.
+ */
+size_t compare_group_buffer(const CompareOptions *options, size_t group_size, int workers);
+
 // Callback function type: invoked when a set of duplicate files is found.
 // The 'duplicates' structure and its 'paths' are valid only for the duration of the callback.
 // If the user needs to retain this information, they must copy it.
@@ -84,4 +135,49 @@ int compare_files_async(
     char **error_message_out
 );
 
+/**
+ * Same as compare_files_async, with all tuning passed in an options structure.
+ *
+ * @param file_paths Array of file paths.
+ * @param count Number of files in the file_paths array.
+ * @param options Comparison options (see init_compare_options); NULL means defaults.
+ * @param callback The callback function to be invoked for each duplicate set.
+ * @param user_data Arbitrary data pointer to be passed to the callback.
+ * @param error_message_out Error message output, see compare_files_async.
+ * @return 0 on success, non-zero on error.
+ */
+int compare_files_async_opts(
+    char *file_paths[],
+    int count,
+    const CompareOptions *options,
+    DuplicateFoundCallback callback,
+    void *user_data,
+    char **error_message_out
+);
+
+/**
+ * Compare independent pairs of files, pair i being pair_paths[2 * i] and
+ * pair_paths[2 * i + 1]. Both files of a pair are streamed side by side with
+ * growing blocks and the comparison stops at the first mismatch; the setup is
+ * shared by all pairs, so many small pairs can be checked in one call.
+ * compare_files_async_opts takes this path for two files.
+ *
+ * @param pair_paths Array of 2 * pair_count file paths.
+ * @param pair_count Number of pairs.
+ * @param options Comparison options (see init_compare_options); NULL means defaults.
+ * @param callback Invoked for every pair of identical files, in pair order; the
+ *                 indices of the set are positions in pair_paths.
+ * @param user_data Arbitrary data pointer to be passed to the callback.
+ * @param error_message_out Error message output, see compare_files_async.
+ * @return 0 on success, otherwise the first error met; the other pairs are still compared.
+ */
+int compare_pairs_async(
+    char *pair_paths[],
+    int pair_count,
+    const CompareOptions *options,
+    DuplicateFoundCallback callback,
+    void *user_data,
+    char **error_message_out
+);
+
 #endif
\ No newline at end of file
@@ -1,209 +1,1198 @@
 #include "fmanage.h"
 #include "salloc.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
 
-#define CLOSE_FILES_COUNT 1
+#ifdef _WIN32
+#include <io.h>
+#define FM_OPEN_FLAGS (O_RDONLY | O_BINARY)
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#define FM_OPEN_FLAGS (O_RDONLY | O_CLOEXEC)
+#define FM_HAVE_MMAP
+#define FM_HAVE_OPENAT
+#ifdef O_PATH
+#define FM_DIR_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define FM_DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+#endif
 
-void
-fm_init(fmanage *fm, int limit) {
-    fm->count = 0;
+#ifdef __linux__
+#include <linux/btrfs.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#endif
+
+#if defined(__linux__) && !defined(__NR_cachestat)
+#define __NR_cachestat 451
+#endif
+
+#define FM_MAP_WINDOW (16 * 1024 * 1024)
+#define FM_NOFILE_MAX 65536         // soft limit of open files asked for at most
+#define FM_DEFAULT_LIMIT_MAX 1024   // default number of files kept open by a comparison at most
+#define FM_DIR_SLOTS_MAX 64
+#define FM_ROTATIONAL_CACHE 16      // devices whose kind is remembered
+
+// Filesystems whose files may share extents (statfs f_type)
+#define FM_BTRFS_MAGIC 0x9123683EU
+#define FM_XFS_MAGIC 0x58465342U
+#define FM_OCFS2_MAGIC 0x7461636FU
+#define FM_BCACHEFS_MAGIC 0xCA451A4EU
+
+static pthread_once_t fm_limit_once = PTHREAD_ONCE_INIT;
+static int fm_limit_default = FOPEN_MAX;
+
+/**
+ * Raise the soft limit of open files and derive the default from it. Half of
+ * the soft limit is left to directory scans, directory handles and the rest of
+ * the process.
+ */
+static void
+fm_limit_init(void) {
+#ifndef _WIN32
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return;
+    }
+    rlim_t want = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > FM_NOFILE_MAX ? FM_NOFILE_MAX : rl.rlim_max;
+#ifdef OPEN_MAX
+    // macOS refuses soft limits above OPEN_MAX even with an unlimited hard limit
+    if (want > OPEN_MAX) {
+        want = OPEN_MAX;
+    }
+#endif
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < want) {
+        struct rlimit raised = rl;
+        raised.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            rl = raised;
+        }
+    }
+    rlim_t soft = rl.rlim_cur == RLIM_INFINITY ? FM_NOFILE_MAX : rl.rlim_cur;
+    int limit = soft / 2 > FM_DEFAULT_LIMIT_MAX ? FM_DEFAULT_LIMIT_MAX : (int) (soft / 2);
+    if (limit > fm_limit_default) {
+        fm_limit_default = limit;
+    }
+#endif
+}
+
+int
+fm_default_limit(void) {
+    pthread_once(&fm_limit_once, fm_limit_init);
+    return fm_limit_default;
+}
+
+#ifdef _WIN32
+/**
+ * Positional read for systems without pread, the descriptor offset is not shared.
+ */
+static ssize_t
+fm_pread(int fd, void *buf, size_t size, off_t off) {
+    if (_lseeki64(fd, off, SEEK_SET) < 0) {
+        return -1;
+    }
+    return read(fd, buf, (unsigned int) size);
+}
+#else
+#define fm_pread pread
+#endif
+
+/**
+ * Note the data segment of a file from its metadata: a file with as many
+ * blocks as bytes has no holes, other files are asked with SEEK_DATA.
+ */
+static void
+fm_data_init(fm_FILE *ff, const struct stat *st) {
+    ff->hole_start = 0;
+    ff->data_start = 0;
+    ff->data_end = -1;
+#ifndef _WIN32
+    if ((off_t) st->st_blocks * 512 >= st->st_size) {
+        ff->data_end = st->st_size;
+    }
+#else
+    ff->data_end = st->st_size;
+#endif
+}
+
+/**
+ * Preferred I/O size of a file.
+ */
+static size_t
+fm_blksize(const struct stat *st) {
+#ifdef _WIN32
+    (void) st;
+    return 4096;
+#else
+    return st->st_blksize > 0 ? (size_t) st->st_blksize : 0;
+#endif
+}
+
+int
+fm_init(fmanage *fm, int limit, int use_mmap) {
+    memset(fm, 0, sizeof(fmanage));
+    if (limit <= 0) {
+        return EINVAL;
+    }
+#ifdef FM_HAVE_OPENAT
+    // Directory handles come out of the limit, which bounds every descriptor held
+    fm->dir_slots = limit / 4 < FM_DIR_SLOTS_MAX ? limit / 4 : FM_DIR_SLOTS_MAX;
+    limit -= fm->dir_slots;
+#endif
     fm->limit = limit;
-    fm->head = (fm_FILE *) salloc(sizeof(fm_FILE), handle_exit);
-    fm->tail = (fm_FILE *) salloc(sizeof(fm_FILE), handle_exit);
-    fm->head->next = fm->tail;
-    fm->head->prev = NULL;
-    fm->tail->next = NULL;
-    fm->tail->prev = fm->head;
+#ifdef FM_HAVE_MMAP
+    fm->use_mmap = use_mmap;
+#else
+    (void) use_mmap;
+#endif
+    fm->slot_file = (fm_FILE **) salloc(sizeof(fm_FILE *) * limit, NULL);
+    fm->slot_prev = (int *) salloc(sizeof(int) * limit, NULL);
+    fm->slot_next = (int *) salloc(sizeof(int) * limit, NULL);
+    if (!fm->slot_file || !fm->slot_prev || !fm->slot_next) {
+        fm_free(fm);
+        return ENOMEM;
+    }
+    for (int i = 0; i < limit; i++) {
+        fm->slot_file[i] = NULL;
+        fm->slot_next[i] = i + 1 < limit ? i + 1 : -1;
+    }
+    fm->head = -1;
+    fm->tail = -1;
+    fm->free_slot = 0;
+
+#ifdef FM_HAVE_OPENAT
+    if (fm->dir_slots > 0) {
+        fm->dir_fd = (int *) salloc(sizeof(int) * fm->dir_slots, NULL);
+        fm->dir_path = (char **) salloc(sizeof(char *) * fm->dir_slots, NULL);
+        fm->dir_path_len = (size_t *) salloc(sizeof(size_t) * fm->dir_slots, NULL);
+        if (!fm->dir_fd || !fm->dir_path || !fm->dir_path_len) {
+            fm_free(fm);
+            return ENOMEM;
+        }
+        for (int i = 0; i < fm->dir_slots; i++) {
+            fm->dir_fd[i] = -1;
+            fm->dir_path[i] = NULL;
+        }
+    }
+#endif
+    return 0;
 }
 
-void
-fm_temp_close_file(fmanage *fm, fm_FILE *ff) {
-    if (ff->fd != NULL) {
-        fclose(ff->fd);
-        ff->_errno = errno;
-        ff->fd = NULL;
+int
+fm_limit_for(int files) {
+#ifdef FM_HAVE_OPENAT
+    // fm_init keeps limit / 4 handles, that is a third of the files, up to FM_DIR_SLOTS_MAX
+    return files + (files / 3 < FM_DIR_SLOTS_MAX ? files / 3 : FM_DIR_SLOTS_MAX);
+#else
+    return files;
+#endif
+}
 
-        fm->count--;
+/**
+ * Close all directory handles.
+ * @return 1 if a handle was closed
+ */
+static int
+fm_dir_drop(fmanage *fm) {
+    int closed = 0;
+    if (fm->dir_fd == NULL || fm->dir_path == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < fm->dir_slots; i++) {
+        if (fm->dir_fd[i] >= 0) {
+            close(fm->dir_fd[i]);
+            closed = 1;
+        }
+        fm->dir_fd[i] = -1;
+        free(fm->dir_path[i]);
+        fm->dir_path[i] = NULL;
+    }
+    return closed;
+}
 
-        ff->prev->next = ff->next;
-        ff->next->prev = ff->prev;
+#ifdef FM_HAVE_OPENAT
+/**
+ * Handle of the directory of a file. Directories hash to a slot, a directory
+ * taking the slot of another one closes its handle.
+ * @return directory descriptor, -1 if it cannot be opened
+ */
+static int
+fm_dir_handle(fmanage *fm, const char *dir, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) dir[i]) * 1099511628211ULL;
+    }
+    int slot = (int) (h % (uint64_t) fm->dir_slots);
+    if (fm->dir_fd[slot] >= 0 && fm->dir_path_len[slot] == len && memcmp(fm->dir_path[slot], dir, len) == 0) {
+        return fm->dir_fd[slot];
+    }
+    if (fm->dir_fd[slot] >= 0) {
+        close(fm->dir_fd[slot]);
+        fm->dir_fd[slot] = -1;
+    }
+    free(fm->dir_path[slot]);
+    fm->dir_path[slot] = (char *) salloc(len + 1, NULL);
+    if (fm->dir_path[slot] == NULL) {
+        return -1;
     }
+    memcpy(fm->dir_path[slot], dir, len);
+    fm->dir_path[slot][len] = '\0';
+    fm->dir_path_len[slot] = len;
+    fm->dir_fd[slot] = open(fm->dir_path[slot], FM_DIR_FLAGS);
+    return fm->dir_fd[slot];
 }
+#endif
 
-void
-fm_temp_close_count(fmanage *fm, int count) {
-    for (int i = 0; i < count; i++) {
-        if (fm->count > 0) {
-            fm_temp_close_file(fm, fm->tail->prev);
+/**
+ * Open a file for reading, relative to the handle of its directory when there is one.
+ */
+static int
+fm_open_path(fmanage *fm, fm_FILE *ff) {
+#ifdef FM_HAVE_OPENAT
+    if (fm->dir_slots > 0 && ff->dir_len > 0) {
+        int dirfd = fm_dir_handle(fm, ff->filename, ff->dir_len);
+        if (dirfd >= 0) {
+            return openat(dirfd, ff->filename + ff->dir_len + 1, FM_OPEN_FLAGS);
         }
     }
+#endif
+    return open(ff->filename, FM_OPEN_FLAGS);
 }
 
-void
-fm_free(fmanage *fm) {
-    // Close and free all actual fm_FILE entries
-    fm_FILE *current = fm->head->next;
-    while (current != fm->tail) {
-        fm_FILE *to_free = current;
-        current = current->next;
-        if (to_free->fd != NULL) {
-            fclose(to_free->fd);
-            // No need to adjust fm->count here as we are dismantling everything
+#ifdef FM_HAVE_MMAP
+/**
+ * Number of pages of a file range in the page cache: cachestat on Linux 6.5
+ * and later, otherwise mincore on a temporary mapping of at most the first
+ * FM_MAP_WINDOW bytes of the range.
+ * @param first page aligned offset
+ * @param len length of the range, a multiple of the page size
+ * @return number of cached pages, -1 if unknown
+ */
+static long
+fm_cached_pages(int fd, off_t first, size_t len) {
+#ifdef __linux__
+    struct {
+        uint64_t off;
+        uint64_t len;
+    } range = {(uint64_t) first, (uint64_t) len};
+    struct {
+        uint64_t nr_cache;
+        uint64_t nr_dirty;
+        uint64_t nr_writeback;
+        uint64_t nr_evicted;
+        uint64_t nr_recently_evicted;
+    } cs;
+    if (syscall(__NR_cachestat, fd, &range, &cs, 0) == 0) {
+        return (long) cs.nr_cache;
+    }
+#endif
+    long page = sysconf(_SC_PAGESIZE);
+    if (len > FM_MAP_WINDOW) {
+        len = FM_MAP_WINDOW;
+    }
+    size_t pages = len / (size_t) page;
+    if (pages == 0) {
+        return 0;
+    }
+    long cached = -1;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, first);
+    if (map != MAP_FAILED) {
+#ifdef __linux__
+        unsigned char *vec = (unsigned char *) salloc(pages, NULL);
+#else
+        char *vec = (char *) salloc(pages, NULL);
+#endif
+        if (vec != NULL && mincore(map, len, vec) == 0) {
+            cached = 0;
+            for (size_t i = 0; i < pages; i++) {
+                cached += vec[i] & 1;
+            }
         }
-        // Assuming filename is managed externally and not sstrdup'd by fmanage itself
-        free(to_free);
+        free(vec);
+        munmap(map, len);
     }
+    return cached;
+}
+#endif
 
-    // Free the sentinel nodes
-    free(fm->head);
-    free(fm->tail);
-    fm->head = NULL; // Avoid dangling pointers
-    fm->tail = NULL;
+/**
+ * Drop a range of a file from the page cache, if the file is read cache neutral.
+ * @param len length of the range, 0 up to the end of the file
+ */
+static void
+fm_drop_range(fm_FILE *ff, int fd, off_t off, off_t len) {
+#if defined(POSIX_FADV_DONTNEED) && !defined(F_NOCACHE)
+    if (ff->drop > 0 && fd >= 0) {
+        posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+    }
+#else
+    (void) ff;
+    (void) fd;
+    (void) off;
+    (void) len;
+#endif
 }
 
-void
-fm_reopen(fmanage *fm, fm_FILE *ff) {
-    FILE *fd = NULL;
-    while (fm->count >= fm->limit) {
-        fm_temp_close_count(fm, fm->limit - fm->count + 1);
+/**
+ * Drop the pages of a file read so far, up to end, from the page cache.
+ */
+static void
+fm_drop_behind(fm_FILE *ff, int fd, off_t end) {
+#if defined(POSIX_FADV_DONTNEED) && !defined(F_NOCACHE)
+    if (ff->drop > 0 && fd >= 0 && end > ff->dropped) {
+        fm_drop_range(ff, fd, ff->dropped, end - ff->dropped);
+        // The kernel keeps a partial last page, the next call covers it
+        long page = sysconf(_SC_PAGESIZE);
+        ff->dropped = end - end % (page > 0 ? page : 4096);
     }
+#else
+    (void) ff;
+    (void) fd;
+    (void) end;
+#endif
+}
 
-    do {
-        fd = fopen(ff->filename, "r");
-        ff->_errno = errno;
-        if (fd == NULL && errno == EMFILE) {
-            fm_temp_close_count(fm, CLOSE_FILES_COUNT);
-        } else if (fd == NULL) {
-            return; // check the error outside
+/**
+ * Set up a just opened descriptor for cache neutral reads (fm->drop_cache).
+ * Files are read sequentially, and the pages read from a file none of which
+ * was cached when it was first opened are dropped behind the reads: pages
+ * cached for other processes are left alone. macOS reads bypass the cache.
+ */
+static void
+fm_cache_open(fmanage *fm, fm_FILE *ff, int fd) {
+    if (!fm->drop_cache) {
+        return;
+    }
+#if defined(F_NOCACHE)
+    fcntl(fd, F_NOCACHE, 1);
+    ff->drop = 0;
+#elif defined(POSIX_FADV_DONTNEED)
+    if (ff->drop < 0) {
+        struct stat st;
+        long cached = -1;
+        if (fstat(fd, &st) == 0) {
+            long page = sysconf(_SC_PAGESIZE);
+            cached = st.st_size > 0 ? fm_cached_pages(fd, 0, (size_t) ((st.st_size + page - 1) / page * page)) : 0;
         }
-    } while(fd == NULL && fm->count > 0);
+        ff->drop = cached <= 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#ifdef POSIX_FADV_NOREUSE
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+#endif
+#else
+    (void) ff;
+    (void) fd;
+#endif
+}
 
-    if (fd == NULL) {
-        fprintf(stderr, "Failed to allocate file open: %s\n", ff->filename);
-        exit(1);
+/**
+ * Put slot in front of the LRU list.
+ */
+static void
+fm_lru_push(fmanage *fm, int slot) {
+    fm->slot_prev[slot] = -1;
+    fm->slot_next[slot] = fm->head;
+    if (fm->head >= 0) {
+        fm->slot_prev[fm->head] = slot;
+    } else {
+        fm->tail = slot;
     }
+    fm->head = slot;
+}
 
-    ff->fd = fd;
+/**
+ * Take slot out of the LRU list.
+ */
+static void
+fm_lru_remove(fmanage *fm, int slot) {
+    int prev = fm->slot_prev[slot];
+    int next = fm->slot_next[slot];
+    if (prev >= 0) {
+        fm->slot_next[prev] = next;
+    } else {
+        fm->head = next;
+    }
+    if (next >= 0) {
+        fm->slot_prev[next] = prev;
+    } else {
+        fm->tail = prev;
+    }
+}
+
+/**
+ * Mark file as the most recently used one.
+ */
+static void
+fm_lru_touch(fmanage *fm, fm_FILE *ff) {
+    if (ff->slot >= 0 && fm->head != ff->slot) {
+        fm_lru_remove(fm, ff->slot);
+        fm_lru_push(fm, ff->slot);
+    }
+}
 
-    fm->head->next->prev = ff;
-    ff->next = fm->head->next;
-    fm->head->next = ff;
-    ff->prev = fm->head;
+/**
+ * Give a free slot to a just opened (or mapped) file. The caller made room with fm_make_room.
+ */
+static void
+fm_lru_insert(fmanage *fm, fm_FILE *ff) {
+    int slot = fm->free_slot;
+    fm->free_slot = fm->slot_next[slot];
+    fm->slot_file[slot] = ff;
+    ff->slot = slot;
+    fm_lru_push(fm, slot);
     fm->count++;
+}
+
+/**
+ * Close descriptor (or mapping) of a file and release its slot. The file keeps its position.
+ * Cache neutral files drop their pages on the way out: pages read again after a rewind,
+ * read ahead or of the last window are not dropped behind the reads.
+ */
+static void
+fm_temp_close_file(fmanage *fm, fm_FILE *ff) {
+#ifdef FM_HAVE_MMAP
+    if (ff->map != NULL) {
+        munmap(ff->map, ff->map_len);
+        ff->map = NULL;
+        ff->map_len = 0;
+    }
+#endif
+    if (ff->fd >= 0) {
+        fm_drop_range(ff, ff->fd, 0, 0);
+        close(ff->fd);
+        ff->fd = -1;
+    }
+    if (ff->slot >= 0) {
+        int slot = ff->slot;
+        fm_lru_remove(fm, slot);
+        fm->slot_file[slot] = NULL;
+        fm->slot_next[slot] = fm->free_slot;
+        fm->free_slot = slot;
+        ff->slot = -1;
+        fm->count--;
+    }
+}
+
+/**
+ * Close the least recently used files until another one may be opened.
+ */
+static void
+fm_make_room(fmanage *fm) {
+    while (fm->count >= fm->limit && fm->tail >= 0) {
+        fm_temp_close_file(fm, fm->slot_file[fm->tail]);
+    }
+}
+
+/**
+ * Open descriptor of file, closing least recently used files when the process runs out of descriptors.
+ * @return descriptor, -1 on failure (ff->_errno is set)
+ */
+static int
+fm_open_fd(fmanage *fm, fm_FILE *ff) {
+    fm_make_room(fm);
+    for (;;) {
+        int fd = fm_open_path(fm, ff);
+        if (fd >= 0) {
+            return fd;
+        }
+        if ((errno == EMFILE || errno == ENFILE) && fm->tail >= 0) {
+            fm_temp_close_file(fm, fm->slot_file[fm->tail]);
+        } else if ((errno == EMFILE || errno == ENFILE) && fm_dir_drop(fm)) {
+            continue;
+        } else if (errno != EINTR) {
+            ff->_errno = errno;
+            return -1;
+        }
+    }
+}
+
+/**
+ * (Re)open file at its position, no seek is needed as reads are positional.
+ * @return 0 on success, errno value on failure
+ */
+static int
+fm_reopen(fmanage *fm, fm_FILE *ff) {
+    int fd = fm_open_fd(fm, ff);
+    if (fd < 0) {
+        return ff->_errno;
+    }
+    ff->fd = fd;
+    fm_cache_open(fm, ff, fd);
+    fm_lru_insert(fm, ff);
+    return 0;
+}
+
+void
+fm_free(fmanage *fm) {
+    // Close everything still open, the fm_FILE structures belong to the caller
+    if (fm->slot_file) {
+        for (int i = 0; i < fm->limit; i++) {
+            if (fm->slot_file[i] != NULL) {
+                fm_temp_close_file(fm, fm->slot_file[i]);
+            }
+        }
+    }
+    fm_dir_drop(fm);
+    free(fm->slot_file);
+    free(fm->slot_prev);
+    free(fm->slot_next);
+    free(fm->dir_fd);
+    free(fm->dir_path);
+    free(fm->dir_path_len);
+    fm->slot_file = NULL;
+    fm->slot_prev = NULL;
+    fm->slot_next = NULL;
+    fm->dir_fd = NULL;
+    fm->dir_path = NULL;
+    fm->dir_path_len = NULL;
+    fm->dir_slots = 0;
+    fm->count = 0;
+}
+
+#ifdef FM_HAVE_MMAP
+/**
+ * Map a window of the file covering [ff->pos, ff->pos + need). The file is
+ * opened only for the mmap call, so a mapping does not hold a descriptor,
+ * unless its pages are dropped from the page cache when it is unmapped.
+ * The size of the file is checked again first: a file that shrank is mapped
+ * up to its new end, and no window is mapped at or past it.
+ * @param fm file manager
+ * @param ff file
+ * @param need number of bytes that must be covered
+ * @return 0 on success, errno value on failure (also stored in ff->_errno)
+ */
+static int
+fm_map_window(fmanage *fm, fm_FILE *ff, size_t need) {
+    // A kept descriptor serves the next window, the pages ahead stay cached
+    int fd = ff->fd;
+    ff->fd = -1;
+    fm_temp_close_file(fm, ff);
+
+    if (fd < 0) {
+        fd = fm_open_fd(fm, ff);
+        if (fd < 0) {
+            return ff->_errno;
+        }
+    }
+
+    // Pages past the end of a file truncated since it was opened raise SIGBUS when
+    // touched, the window ends at the new end: the data is cut short, as pread sees it
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size < ff->size) {
+        ff->size = st.st_size;
+    }
+    if (ff->pos >= ff->size) {
+        fm_drop_range(ff, fd, 0, 0);
+        close(fd);
+        return 0;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    off_t map_off = ff->pos - ff->pos % (page > 0 ? page : 4096);
+    size_t map_len = (size_t) (ff->pos - map_off) + need;
+    if (map_len < FM_MAP_WINDOW) {
+        map_len = FM_MAP_WINDOW;
+    }
+    if ((off_t) map_len > ff->size - map_off) {
+        map_len = (size_t) (ff->size - map_off);
+    }
+
+    // The previous window was unmapped, its pages may be dropped now
+    fm_cache_open(fm, ff, fd);
+    fm_drop_behind(ff, fd, map_off);
 
-    fseek(fd, ff->pos, SEEK_SET);
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_off);
+    int map_errno = errno;
+    if (map == MAP_FAILED || ff->drop <= 0) {
+        close(fd);
+    } else {
+        ff->fd = fd;
+    }
+    if (map == MAP_FAILED) {
+        ff->_errno = map_errno;
+        return ff->_errno;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, map_len, MADV_SEQUENTIAL);
+#endif
+    ff->map = (char *) map;
+    ff->map_len = map_len;
+    ff->map_off = map_off;
+    fm_lru_insert(fm, ff);
+    return 0;
 }
+#endif
 
 fm_FILE *
 fm_fopen(fmanage *fm, char *filename) {
-    fm_FILE *ff = NULL;
-
-    while (ff == NULL) {
-        if (fm->count < fm->limit) {
-            errno = 0; // Clear errno before calling a function that might set it
-            FILE *fd = fopen(filename, "r");
-            if (fd != NULL) {
-                ff = (fm_FILE *) salloc(sizeof(fm_FILE),
-                                        handle_exit);
-                ff->filename = filename;
-                ff->pos = 0;
-                ff->fd = fd;
-                ff->_errno = 0; // CRITICAL: Set to 0 on successful open
-
-                fm->head->next->prev = ff;
-                ff->next = fm->head->next;
-                fm->head->next = ff;
-                ff->prev = fm->head;
-                fm->count++;
-            } else {
-                // fopen failed, errno is now set by fopen
-                ff = NULL; // Ensure ff remains NULL for the loop condition
-                if (errno != EMFILE) {
-                    // For other errors (e.g. ENOENT), return NULL immediately to signal to caller
-                    // The caller (compare_files) will then use the current errno value.
-                    return NULL;
-                }
-                // If EMFILE, loop will continue to try closing other files
-            }
+    fm_FILE *ff = (fm_FILE *) salloc(sizeof(fm_FILE), NULL);
+    if (ff == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ff->filename = filename;
+    ff->pos = 0;
+    ff->fd = -1;
+    ff->_errno = 0;
+    ff->map = NULL;
+    ff->map_len = 0;
+    ff->map_off = 0;
+    ff->size = -1;
+    ff->blksize = 0;
+    ff->hole_start = 0;
+    ff->data_start = 0;
+    ff->data_end = -1;
+    ff->drop = -1;
+    ff->dropped = 0;
+    ff->slot = -1;
+    const char *base = strrchr(filename, '/');
+    ff->dir_len = base != NULL ? (size_t) (base - filename) : 0;
+
+#ifdef FM_HAVE_MMAP
+    if (fm->use_mmap) {
+        // Mapped files learn their size up front, an empty file is never mapped
+        struct stat st;
+        if (stat(filename, &st) != 0) {
+            free(ff);
+            return NULL;
         }
-        if (ff == NULL) {
-            fm_temp_close_count(fm, CLOSE_FILES_COUNT);
+        ff->size = st.st_size;
+        ff->blksize = fm_blksize(&st);
+        fm_data_init(ff, &st);
+        if (ff->size > 0 && fm_map_window(fm, ff, 1) != 0) {
+            errno = ff->_errno;
+            free(ff);
+            return NULL;
         }
+        return ff;
     }
+#endif
 
+    if (fm_reopen(fm, ff) != 0) {
+        errno = ff->_errno;
+        free(ff);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(ff->fd, &st) == 0) {
+        ff->size = st.st_size;
+        ff->blksize = fm_blksize(&st);
+        fm_data_init(ff, &st);
+    }
     return ff;
 }
 
+size_t
+fm_fmap(fmanage *fm, fm_FILE *ff, size_t size, const char **ptr) {
+    *ptr = NULL;
+#ifdef FM_HAVE_MMAP
+    if (ff == NULL || ff->_errno != 0 || ff->pos >= ff->size) {
+        return 0;
+    }
+    size_t avail = size;
+    if ((off_t) avail > ff->size - ff->pos) {
+        avail = (size_t) (ff->size - ff->pos);
+    }
+    if (ff->map == NULL || ff->pos < ff->map_off ||
+        ff->pos + (off_t) avail > ff->map_off + (off_t) ff->map_len) {
+        if (fm_map_window(fm, ff, avail) != 0 || ff->pos >= ff->size) {
+            return 0;
+        }
+        if ((off_t) avail > ff->size - ff->pos) {
+            avail = (size_t) (ff->size - ff->pos);
+        }
+    } else {
+        fm_lru_touch(fm, ff);
+    }
+    *ptr = ff->map + (ff->pos - ff->map_off);
+    ff->pos += avail;
+    fm->total_readed += avail;
+    return avail;
+#else
+    (void) fm;
+    (void) ff;
+    (void) size;
+    return 0;
+#endif
+}
+
 size_t
 fm_fread(fmanage *fm, void *ptr, size_t size, size_t nmemb, fm_FILE *ff) {
+    if (ff == NULL || size == 0) {
+        return 0;
+    }
+    if (fm->use_mmap) {
+        // Mapped files are copied out, used when a group has more files than mappings allowed
+        const char *data;
+        size_t cnt = fm_fmap(fm, ff, size * nmemb, &data);
+        if (cnt > 0) {
+            memcpy(ptr, data, cnt);
+        }
+        return cnt / size;
+    }
+    if (fm_fileno(fm, ff) < 0) {
+        return 0;
+    }
+
+    size_t want = size * nmemb;
+    size_t cnt = 0;
+    while (cnt < want) {
+        ssize_t ret = fm_pread(ff->fd, (char *) ptr + cnt, want - cnt, ff->pos + (off_t) cnt);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            ff->_errno = errno;
+            break;
+        }
+        if (ret == 0) {
+            break; // end of file
+        }
+        cnt += (size_t) ret;
+    }
+    fm_advance(fm, ff, cnt);
+    return cnt / size;
+}
+
+size_t
+fm_pread_at(fmanage *fm, fm_FILE *ff, void *ptr, size_t size, off_t off) {
+    if (ff == NULL || ff->_errno != 0) {
+        return 0;
+    }
+    size_t cnt = 0;
+    if (fm->use_mmap) {
+        // Map around the offset, the sequential position is restored afterwards
+        off_t pos = ff->pos;
+        const char *data;
+        ff->pos = off;
+        cnt = fm_fmap(fm, ff, size, &data);
+        if (cnt > 0) {
+            memcpy(ptr, data, cnt);
+        }
+        ff->pos = pos;
+        return cnt;
+    }
+    if (fm_fileno(fm, ff) < 0) {
+        return 0;
+    }
+    while (cnt < size) {
+        ssize_t ret = fm_pread(ff->fd, (char *) ptr + cnt, size - cnt, off + (off_t) cnt);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            ff->_errno = errno;
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+        cnt += (size_t) ret;
+    }
+    fm_drop_range(ff, ff->fd, off, (off_t) cnt);
+    fm->total_readed += cnt;
+    return cnt;
+}
+
+int
+fm_fileno(fmanage *fm, fm_FILE *ff) {
+    if (ff->_errno != 0 || fm->use_mmap) {
+        return -1;
+    }
+    if (ff->fd < 0) {
+        if (fm_reopen(fm, ff) != 0) {
+            return -1;
+        }
+    } else {
+        fm_lru_touch(fm, ff);
+    }
+    return ff->fd;
+}
+
+void
+fm_advance(fmanage *fm, fm_FILE *ff, size_t cnt) {
+    ff->pos += cnt;
+    fm->total_readed += cnt;
+    fm_drop_behind(ff, ff->fd, ff->pos);
+}
+
+void
+fm_willneed(fmanage *fm, fm_FILE *ff, size_t size) {
+    if (ff == NULL || ff->_errno != 0 || size == 0) {
+        return;
+    }
+    if (ff->size >= 0) {
+        if (ff->pos >= ff->size) {
+            return;
+        }
+        if ((off_t) size > ff->size - ff->pos) {
+            size = (size_t) (ff->size - ff->pos);
+        }
+    }
+#ifdef FM_HAVE_MMAP
+    if (fm->use_mmap) {
+#ifdef MADV_WILLNEED
+        // Only the mapped window is hinted, a remap would cost more than the hint saves
+        off_t map_end = ff->map_off + (off_t) ff->map_len;
+        if (ff->map == NULL || ff->pos < ff->map_off || ff->pos >= map_end) {
+            return;
+        }
+        if ((off_t) size > map_end - ff->pos) {
+            size = (size_t) (map_end - ff->pos);
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        size_t skip = (size_t) (ff->pos - ff->map_off);
+        skip -= skip % (size_t) (page > 0 ? page : 4096);
+        madvise(ff->map + skip, (size_t) (ff->pos - ff->map_off) - skip + size, MADV_WILLNEED);
+#endif
+        return;
+    }
+#endif
+    // A closed file is not reopened just for a hint
+    if (ff->fd < 0) {
+        return;
+    }
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(ff->fd, ff->pos, (off_t) size, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory ra;
+    ra.ra_offset = ff->pos;
+    ra.ra_count = size > INT_MAX ? INT_MAX : (int) size;
+    fcntl(ff->fd, F_RDADVISE, &ra);
+#else
+    (void) fm;
+#endif
+}
+
+void
+fm_release(fmanage *fm, fm_FILE *ff) {
     if (ff != NULL) {
-        if (ff->_errno != 0 && ff->_errno != ENOENT) { // Allow reading attempt if only ENOENT was set by a previous failed open that was ignored by ufsorter
-                                                 // ENOENT on ff might mean it was never successfully opened in the first place.
-                                                 // A better approach might be to not even attempt fread if ff->fd is NULL from a failed fopen.
-                                                 // Let's assume for now ff->_errno != 0 is a hard error for reading.
-             if (ff->_errno != 0) return 0; // If ff carries an error from open/previous read, don't proceed.
-        }
-
-        if (ff->fd == NULL) {
-            // File might be temporarily closed or never successfully opened.
-            // If never opened (e.g. fm_fopen returned NULL and caller still tried to use it),
-            // or if fm_reopen fails, this will be an issue.
-            // The current design expects fm_reopen to handle it.
-            errno = 0; // Clear errno before reopen
-            fm_reopen(fm, ff);
-            if (ff->fd == NULL) { // Reopen failed
-                // ff->_errno should have been set by fm_reopen if it failed to open the file.
-                // If it wasn't (e.g. fm_reopen exited), then this is problematic.
-                // Assuming fm_reopen sets ff->_errno if it returns with ff->fd == NULL
-                // fprintf(stderr, "Error reopening %s: %s\n", ff->filename, strerror(ff->_errno ? ff->_errno : errno));
-                return 0; // Indicate read failure
-            }
+        fm_temp_close_file(fm, ff);
+    }
+}
+
+/**
+ * Physical offset of a file position on its device.
+ * @return 0 on success, -1 if unknown
+ */
+static int
+fm_device_offset(int fd, off_t pos, size_t blksize, uint64_t *offset) {
+#if defined(FS_IOC_FIEMAP)
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.map.fm_start = (uint64_t) pos;
+    req.map.fm_length = 1;
+    req.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &req) == 0 && req.map.fm_mapped_extents == 1
+        && !(req.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))
+        && req.extent.fe_logical <= (uint64_t) pos) {
+        *offset = req.extent.fe_physical + ((uint64_t) pos - req.extent.fe_logical);
+        return 0;
+    }
+#endif
+#if defined(FIBMAP)
+    // Needs CAP_SYS_RAWIO, filesystems without FIEMAP may still answer
+    if (blksize > 0 && pos / (off_t) blksize <= INT_MAX) {
+        int blk = (int) (pos / (off_t) blksize);
+        if (ioctl(fd, FIBMAP, &blk) == 0 && blk > 0) {
+            *offset = (uint64_t) blk * blksize + (uint64_t) (pos % (off_t) blksize);
+            return 0;
         }
+    }
+#endif
+#if defined(F_LOG2PHYS_EXT)
+    struct log2phys l2p;
+    memset(&l2p, 0, sizeof(l2p));
+    l2p.l2p_devoffset = pos;
+    l2p.l2p_contigbytes = 1;
+    if (fcntl(fd, F_LOG2PHYS_EXT, &l2p) == 0) {
+        *offset = (uint64_t) l2p.l2p_devoffset;
+        return 0;
+    }
+#endif
+    (void) fd;
+    (void) pos;
+    (void) blksize;
+    (void) offset;
+    return -1;
+}
 
-        errno = 0; // Clear errno before calling fread
-        size_t cnt = fread(ptr, size, nmemb, ff->fd);
-        // After fread, errno is set ONLY IF an error occurred.
-        // If EOF, feof(ff->fd) is true. If error, ferror(ff->fd) is true.
-
-        // Store errno only if a read error actually occurred.
-        // fread returns a short count on EOF or error.
-        if (cnt < nmemb && ferror(ff->fd)) {
-            ff->_errno = errno; // Store actual read error
-        } else {
-            // No read error, or just EOF. Don't overwrite a previous ff->_errno from open phase
-            // unless explicitly clearing it. If open was successful, ff->_errno was 0.
-            // If it was EOF, ff->_errno should remain 0 for this path.
-            if (ff->_errno == 0) { // If no prior error on this fm_FILE struct
-                 // do not set ff->_errno from global errno here if it was just EOF
-            }
+uint64_t
+fm_physical(fmanage *fm, fm_FILE *ff) {
+    if (ff == NULL || ff->_errno != 0) {
+        return UINT64_MAX;
+    }
+    // Mapped files hold no descriptor, one is opened for the query
+    int fd = fm->use_mmap ? fm_open_path(fm, ff) : fm_fileno(fm, ff);
+    if (fd < 0) {
+        return UINT64_MAX;
+    }
+    uint64_t key;
+    struct stat st;
+    if (fm_device_offset(fd, ff->pos, ff->blksize, &key) != 0) {
+        key = fstat(fd, &st) == 0 ? (uint64_t) st.st_ino : 0;
+    }
+    if (fm->use_mmap) {
+        close(fd);
+    }
+    return key;
+}
+
+int
+fm_rotational(const char *path) {
+#ifdef __linux__
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static dev_t cache_dev[FM_ROTATIONAL_CACHE];
+    static int cache_rot[FM_ROTATIONAL_CACHE];
+    static int cache_count;
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < cache_count && i < FM_ROTATIONAL_CACHE; i++) {
+        if (cache_dev[i] == st.st_dev) {
+            int rot = cache_rot[i];
+            pthread_mutex_unlock(&lock);
+            return rot;
         }
-        // The old code: ff->_errno = errno; was too broad.
-        // It should be: if (ferror(ff->fd)) ff->_errno = errno; else if successful open ff->_errno = 0 for read;
+    }
+    pthread_mutex_unlock(&lock);
 
-        fm->total_readed += cnt; // This seems to be a global counter in fmanage, its utility isn't clear here.
-        ff->pos += cnt;
+    // Partitions have no queue of their own, the disk holding them has
+    int rot = 0;
+    const char *formats[] = {"/sys/dev/block/%u:%u/queue/rotational", "/sys/dev/block/%u:%u/../queue/rotational"};
+    for (int k = 0; k < 2; k++) {
+        char name[64];
+        snprintf(name, sizeof(name), formats[k], major(st.st_dev), minor(st.st_dev));
+        FILE *f = fopen(name, "r");
+        if (f != NULL) {
+            rot = fgetc(f) == '1';
+            fclose(f);
+            break;
+        }
+    }
 
-        // LRU cache update
-        ff->prev->next = ff->next;
-        ff->next->prev = ff->prev;
-        fm->head->next->prev = ff;
-        ff->next = fm->head->next;
-        fm->head->next = ff;
-        ff->prev = fm->head;
+    pthread_mutex_lock(&lock);
+    cache_dev[cache_count % FM_ROTATIONAL_CACHE] = st.st_dev;
+    cache_rot[cache_count % FM_ROTATIONAL_CACHE] = rot;
+    cache_count++;
+    pthread_mutex_unlock(&lock);
+    return rot;
+#else
+    (void) path;
+    return 0;
+#endif
+}
 
-        return cnt;
+off_t
+fm_next_data(fmanage *fm, fm_FILE *ff) {
+    if (ff == NULL || ff->_errno != 0 || ff->size < 0 || ff->pos >= ff->size) {
+        return ff != NULL ? ff->pos : 0;
+    }
+    if (ff->data_end >= 0 && ff->pos >= ff->hole_start && ff->pos < ff->data_end) {
+        return ff->pos > ff->data_start ? ff->pos : ff->data_start;
+    }
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    // Mapped files hold no descriptor, one is opened for the query
+    int fd = fm->use_mmap ? fm_open_path(fm, ff) : fm_fileno(fm, ff);
+    if (fd < 0) {
+        return ff->pos;
+    }
+    ff->hole_start = ff->pos;
+    off_t data = lseek(fd, ff->pos, SEEK_DATA);
+    off_t hole = data >= 0 ? lseek(fd, data, SEEK_HOLE) : -1;
+    if (data < 0 && errno == ENXIO) {
+        // Only a hole up to the end of the file
+        ff->data_start = ff->size;
+        ff->data_end = ff->size;
+    } else if (data >= 0 && hole > data) {
+        ff->data_start = data;
+        ff->data_end = hole;
+    } else {
+        // Not supported, the rest of the file is read
+        ff->data_start = ff->pos;
+        ff->data_end = ff->size;
+    }
+    if (fm->use_mmap) {
+        close(fd);
+    }
+    return ff->pos > ff->data_start ? ff->pos : ff->data_start;
+#else
+    (void) fm;
+    return ff->pos;
+#endif
+}
+
+int
+fm_resident(fmanage *fm, fm_FILE *ff, off_t off, size_t len) {
+#ifdef FM_HAVE_MMAP
+    if (ff == NULL || ff->_errno != 0 || len == 0) {
+        return 0;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    off_t first = off - off % page;
+    size_t pages = (size_t) ((off + (off_t) len - first + page - 1) / page);
+    int fd = fm->use_mmap ? fm_open_path(fm, ff) : fm_fileno(fm, ff);
+    if (fd < 0) {
+        return 0;
+    }
+    int resident = pages * (size_t) page <= FM_MAP_WINDOW
+                   && fm_cached_pages(fd, first, pages * (size_t) page) >= (long) pages;
+    if (fm->use_mmap) {
+        close(fd);
+    }
+    return resident;
+#else
+    (void) fm;
+    (void) ff;
+    (void) off;
+    (void) len;
+    return 0;
+#endif
+}
+
+int
+fm_cached_any(fmanage *fm, fm_FILE *ff) {
+#ifdef FM_HAVE_MMAP
+    if (ff == NULL || ff->_errno != 0 || ff->size <= 0) {
+        return 0;
     }
+    long page = sysconf(_SC_PAGESIZE);
+    int fd = fm->use_mmap ? fm_open_path(fm, ff) : fm_fileno(fm, ff);
+    if (fd < 0) {
+        return 0;
+    }
+    int cached = fm_cached_pages(fd, 0, (size_t) ((ff->size + page - 1) / page * page)) > 0;
+    if (fm->use_mmap) {
+        close(fd);
+    }
+    return cached;
+#else
+    (void) fm;
+    (void) ff;
     return 0;
+#endif
+}
+
+int
+fm_reflinks(const char *path) {
+#ifdef __linux__
+    struct statfs sf;
+    if (statfs(path, &sf) != 0) {
+        return 0;
+    }
+    uint32_t type = (uint32_t) sf.f_type;   // magics are 32 bits, f_type is signed on some targets
+    return type == FM_BTRFS_MAGIC || type == FM_XFS_MAGIC || type == FM_OCFS2_MAGIC || type == FM_BCACHEFS_MAGIC;
+#else
+    (void) path;
+    return 0;
+#endif
+}
+
+#if defined(FS_IOC_FIEMAP)
+/**
+ * Key of the filesystem holding a file: its device number, or on btrfs, whose
+ * subvolumes each have a device number of their own, the filesystem UUID.
+ * Extent addresses of btrfs are logical addresses of the whole filesystem.
+ */
+static uint64_t
+fm_fs_key(int fd, const struct stat *st) {
+#ifdef BTRFS_IOC_FS_INFO
+    struct statfs sf;
+    if (fstatfs(fd, &sf) == 0 && (uint32_t) sf.f_type == FM_BTRFS_MAGIC) {
+        struct btrfs_ioctl_fs_info_args info;
+        memset(&info, 0, sizeof(info));
+        if (ioctl(fd, BTRFS_IOC_FS_INFO, &info) == 0) {
+            uint64_t id[2];
+            memcpy(id, info.fsid, sizeof(id));
+            return id[0] ^ id[1];
+        }
+    }
+#endif
+    return (uint64_t) st->st_dev;
+}
+#endif
+
+int
+fm_extent_map(fmanage *fm, fm_FILE *ff, uint64_t *fs, fm_extent *ext, int max) {
+#if defined(FS_IOC_FIEMAP)
+    if (ff == NULL || ff->_errno != 0 || max <= 0) {
+        return -1;
+    }
+    struct fiemap *map = (struct fiemap *) salloc(sizeof(struct fiemap) + sizeof(struct fiemap_extent) * max, NULL);
+    if (map == NULL) {
+        return -1;
+    }
+    int fd = fm->use_mmap ? fm_open_path(fm, ff) : fm_fileno(fm, ff);
+    int n = -1;
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        memset(map, 0, sizeof(struct fiemap));
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_flags = FIEMAP_FLAG_SYNC;   // delayed allocations get their blocks
+        map->fm_extent_count = (uint32_t) max;
+        if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0) {
+            n = (int) map->fm_mapped_extents;
+        }
+    }
+    // The physical address must identify the data: no inline, packed, compressed or unknown extents,
+    // and the map must reach the last extent of the file
+    const uint32_t opaque = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED
+                            | FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL;
+    if (n > 0 && !(map->fm_extents[n - 1].fe_flags & FIEMAP_EXTENT_LAST)) {
+        n = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        const struct fiemap_extent *fe = &map->fm_extents[i];
+        if (fe->fe_flags & opaque) {
+            n = -1;
+            break;
+        }
+        ext[i].logical = (off_t) fe->fe_logical;
+        ext[i].physical = fe->fe_physical;
+        ext[i].length = (off_t) fe->fe_length;
+    }
+    if (n > 0) {
+        *fs = fm_fs_key(fd, &st);
+    }
+    if (fm->use_mmap && fd >= 0) {
+        close(fd);
+    }
+    free(map);
+    return n;
+#else
+    (void) fm;
+    (void) ff;
+    (void) fs;
+    (void) ext;
+    (void) max;
+    return -1;
+#endif
 }
 
 void
 fm_fclose(fmanage *fm, fm_FILE *ff) {
     fm_temp_close_file(fm, ff);
-    ff->fd = NULL;
     ff->filename = NULL;
-    ff->next = NULL;
-    ff->prev = NULL;
     ff->pos = -1;
     ff->_errno = -1;
     free(ff);
@@ -1,36 +1,242 @@
 #ifndef _FMANAGE_H
 #define _FMANAGE_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 typedef struct fm_FILE {
     char *filename;
-    long int pos;
-    FILE *fd;
+    off_t pos;      // offset of the next read, kept while the file is temporarily closed
+    int fd;         // descriptor, -1 while closed
     int _errno;
 
-    struct fm_FILE *prev;
-    struct fm_FILE *next;
+    // mmap mode: currently mapped window of the file
+    char *map;
+    size_t map_len;
+    off_t map_off;
+    off_t size;     // file size when opened, -1 if unknown
+    size_t blksize; // preferred I/O size (st_blksize), 0 until the file was opened
+    size_t dir_len; // length of the directory part of filename, 0 to open it by full path
+    off_t hole_start;   // known layout around pos: a hole up to data_start, data up to data_end,
+    off_t data_start;
+    off_t data_end;     // -1 until known
+    int drop;           // pages read are dropped from the page cache, -1 until the file is opened
+    off_t dropped;      // pages before this offset were dropped
 
+    int slot;       // slot in the LRU of open files, -1 if not open (or mapped)
 } fm_FILE;
 
+// Contiguous range of a file stored at one place of its device
+typedef struct fm_extent {
+    off_t logical;      // offset in the file
+    uint64_t physical;  // offset on the device
+    off_t length;
+} fm_extent;
+
+/*
+ * File manager keeping at most limit files open (or mapped). Open files are
+ * kept in an LRU list made of index links over limit slots, the least
+ * recently used file is closed when another one needs to be opened.
+ */
 typedef struct fmanage {
     int count;
     int limit;
-    fm_FILE *head;
-    fm_FILE *tail;
+    fm_FILE **slot_file;    // file held by each slot
+    int *slot_prev;         // towards the most recently used slot
+    int *slot_next;         // towards the least recently used slot, free list link of free slots
+    int head;               // most recently used slot, -1 if none
+    int tail;               // least recently used slot, -1 if none
+    int free_slot;          // first free slot, -1 if none
     size_t total_readed;
+    int use_mmap;   // files are mapped instead of opened, limit counts mappings
+    int drop_cache; // read cache neutral: pages read from files nobody had cached are dropped, set after fm_init
+
+    // Directory handles: files are (re)opened by base name relative to their directory
+    int dir_slots;          // number of cached directory handles, 0 to open files by full path
+    int *dir_fd;            // handle held by each slot, -1 if empty
+    char **dir_path;        // directory of each slot
+    size_t *dir_path_len;
 } fmanage;
 
-void fm_init(fmanage *fm, int limit);
+/**
+ * Raise the soft limit of open files towards the hard limit (once per
+ * process) and derive from it how many files a comparison keeps open.
+ * @return default open files limit, at least FOPEN_MAX
+ */
+int fm_default_limit(void);
+
+/**
+ * Initialize file manager. Up to limit / 4 (at most 64) of the descriptors are
+ * directory handles, so that files are reopened by their base name; the rest
+ * are files, fm->limit is set to their number.
+ * @param fm file manager
+ * @param limit maximum number of descriptors (files, mappings and directory handles) held at once
+ * @param use_mmap map files instead of reading them
+ * @return 0 on success, ENOMEM or EINVAL on failure
+ */
+int fm_init(fmanage *fm, int limit, int use_mmap);
 
+/**
+ * Limit for fm_init that keeps a number of files open at once besides the
+ * directory handles.
+ * @param files number of files
+ * @return descriptor limit
+ */
+int fm_limit_for(int files);
+
+/**
+ * Open file for reading.
+ * @param fm file manager
+ * @param filename path, must stay valid until fm_fclose
+ * @return file, NULL on failure (errno is set)
+ */
 fm_FILE *fm_fopen(fmanage *fm, char *filename);
 
+/**
+ * Read nmemb items of size bytes from the current position. A file closed
+ * meanwhile is reopened and read at its position with pread, no seek is needed.
+ * @return number of items read, less than nmemb at end of file or on error (ff->_errno is set)
+ */
 size_t fm_fread(fmanage *fm, void *ptr, size_t size, size_t nmemb,
              fm_FILE *stream);
 
+/**
+ * Map the next size bytes of a file (mmap mode). The data stays valid until the
+ * next fm_* call that may remap or evict the file.
+ * @param fm file manager
+ * @param ff file
+ * @param size requested number of bytes
+ * @param ptr output pointer to the data
+ * @return number of bytes available (less than size at the end of file, 0 on EOF or error)
+ */
+size_t fm_fmap(fmanage *fm, fm_FILE *ff, size_t size, const char **ptr);
+
+/**
+ * Read size bytes at offset off without moving the current position.
+ * @param fm file manager
+ * @param ff file
+ * @param ptr destination
+ * @param size number of bytes
+ * @param off file offset
+ * @return number of bytes read, less than size at end of file or on error (ff->_errno is set)
+ */
+size_t fm_pread_at(fmanage *fm, fm_FILE *ff, void *ptr, size_t size, off_t off);
+
+/**
+ * Descriptor of an open file for reads issued outside of fm_fread. The file is
+ * reopened if it was closed meanwhile and becomes the most recently used one.
+ * @param fm file manager
+ * @param ff file
+ * @return file descriptor, -1 on error (ff->_errno is set)
+ */
+int fm_fileno(fmanage *fm, fm_FILE *ff);
+
+/**
+ * Account bytes read from the current position by other means than fm_fread.
+ * @param fm file manager
+ * @param ff file
+ * @param cnt number of bytes read
+ */
+void fm_advance(fmanage *fm, fm_FILE *ff, size_t cnt);
+
+/**
+ * Ask the system to start reading the next size bytes of a file in the
+ * background (posix_fadvise WILLNEED, madvise for the mapped window), so the
+ * next read overlaps with the comparison of the current block. Closed files
+ * are not reopened for a hint.
+ * @param fm file manager
+ * @param ff file
+ * @param size number of bytes from the current position
+ */
+void fm_willneed(fmanage *fm, fm_FILE *ff, size_t size);
+
+/**
+ * Close the descriptor (or mapping) of a file but keep the file at its
+ * position. Another manager may then take the file over, it reopens the file
+ * on its next read.
+ * @param fm file manager holding the file
+ * @param ff file, may be NULL
+ */
+void fm_release(fmanage *fm, fm_FILE *ff);
+
+/**
+ * Sort key placing the next read of a file on its device: the physical
+ * offset of the current position (FIEMAP on Linux, F_LOG2PHYS_EXT on macOS),
+ * or the inode number where the offset is unknown. The file is reopened if it
+ * was closed meanwhile.
+ * @param fm file manager
+ * @param ff file, may be NULL
+ * @return key, UINT64_MAX for a missing or failed file
+ */
+uint64_t fm_physical(fmanage *fm, fm_FILE *ff);
+
+/**
+ * Whether a file lies on a rotational disk, where reads should avoid seeks.
+ * Known on Linux (sysfs), 0 elsewhere; results are cached per device.
+ * @param path file path
+ * @return 1 if the device is rotational, 0 otherwise
+ */
+int fm_rotational(const char *path);
+
+/**
+ * Offset of the first byte of data at or after the current position: the
+ * bytes before it are a hole and read as zeros. Holes are found with
+ * SEEK_DATA and SEEK_HOLE, one query per data segment; files whose blocks
+ * cover their size are known to have no holes without a query.
+ * @param fm file manager
+ * @param ff file, may be NULL
+ * @return offset of the next data, the end of the file if only a hole is left,
+ *         the current position where holes are not known
+ */
+off_t fm_next_data(fmanage *fm, fm_FILE *ff);
+
+/**
+ * Whether a range of a file is in the page cache, so reading it costs no disk
+ * access: cachestat(2) on Linux 6.5 and later, mincore on a temporary mapping
+ * elsewhere (ranges up to FM_MAP_WINDOW). Unknown on Windows.
+ * @param fm file manager
+ * @param ff file, may be NULL
+ * @param off offset of the range
+ * @param len length of the range
+ * @return 1 if every page of the range is cached, 0 if not or unknown
+ */
+int fm_resident(fmanage *fm, fm_FILE *ff, off_t off, size_t len);
+
+/**
+ * Whether any page of a file is in the page cache, with one cachestat(2)
+ * call; mincore only looks at the first FM_MAP_WINDOW bytes.
+ * @param fm file manager
+ * @param ff file, may be NULL
+ * @return 1 if a page is cached, 0 if none is or unknown
+ */
+int fm_cached_any(fmanage *fm, fm_FILE *ff);
+
+/**
+ * Whether the files of a filesystem may share their extents, as reflink copies
+ * and snapshots do on btrfs, XFS, OCFS2 and bcachefs. Known on Linux, 0 elsewhere.
+ * @param path file path
+ * @return 1 if files may share extents, 0 otherwise
+ */
+int fm_reflinks(const char *path);
+
+/**
+ * Physical extent map of a whole file (FIEMAP, Linux). Files with the same map
+ * in the same filesystem hold the same data. Extents whose address does not
+ * tell their data apart (inline, packed, compressed, encrypted or not yet
+ * allocated) make the map unknown.
+ * @param fm file manager
+ * @param ff file, may be NULL
+ * @param fs key of the filesystem of the file, set on success: btrfs subvolumes
+ *           and snapshots have device numbers of their own but share their extents
+ * @param ext extents, ordered by logical offset
+ * @param max size of ext
+ * @return number of extents, -1 if the map is unknown or has more than max extents
+ */
+int fm_extent_map(fmanage *fm, fm_FILE *ff, uint64_t *fs, fm_extent *ext, int max);
+
 void fm_fclose(fmanage *fm, fm_FILE *ff);
 
 void fm_free(fmanage *fm);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,329 @@
+#include "fring.h"
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FR_HAVE_URING
+#endif
+#endif
+
+#ifdef FR_HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "salloc.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+static int
+fr_sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+fr_sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+fr_sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Whether the kernel of a ring reads with IORING_OP_READ (Linux 5.6), older
+ * kernels know neither the opcode nor IORING_REGISTER_PROBE.
+ * @return 0 if supported, ENOSYS otherwise
+ */
+static int
+fr_probe_read(int ring_fd) {
+    unsigned ops = 256;
+    size_t len = sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) salloc(len, NULL);
+    if (probe == NULL) {
+        return ENOMEM;
+    }
+    memset(probe, 0, len);
+    int err = 0;
+    if (fr_sys_register(ring_fd, IORING_REGISTER_PROBE, probe, ops) < 0
+        || probe->last_op < IORING_OP_READ
+        || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)) {
+        err = ENOSYS;
+    }
+    free(probe);
+    return err;
+}
+
+/**
+ * Move the completions of the ring into the res of their reads.
+ * @return number of completions reaped
+ */
+static int
+fr_reap(fring *ring, fr_read *reads) {
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *) ring->cqes;
+    int reaped = 0;
+    unsigned head = *ring->cq_head;
+    unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != cq_tail) {
+        struct io_uring_cqe *cqe = &cqes[head & *ring->cq_mask];
+        // An opcode or file the ring does not handle is read with pread, which tells the real error if any
+        reads[cqe->user_data].res = cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP ? 0 : cqe->res;
+        reaped++;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+int
+fr_init(fring *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(fring));
+    memset(&p, 0, sizeof(p));
+    ring->ring_fd = fr_sys_setup(entries, &p);
+    if (ring->ring_fd < 0) {
+        ring->ring_fd = -1;
+        return errno;
+    }
+    int probe_err = fr_probe_read(ring->ring_fd);
+    if (probe_err != 0) {
+        fr_free(ring);
+        return probe_err;
+    }
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        int err = errno;
+        fr_free(ring);
+        return err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            int err = errno;
+            fr_free(ring);
+            return err;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        int err = errno;
+        fr_free(ring);
+        return err;
+    }
+
+    char *sq = (char *) ring->sq_ring;
+    char *cq = (char *) ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    return 0;
+}
+
+int
+fr_register_buffers(fring *ring, char **bufs, int count, size_t size) {
+    struct iovec *iov = (struct iovec *) salloc(sizeof(struct iovec) * count, NULL);
+    if (iov == NULL) {
+        return ENOMEM;
+    }
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = size;
+    }
+    int ret = fr_sys_register(ring->ring_fd, IORING_REGISTER_BUFFERS, iov, count);
+    int err = ret < 0 ? errno : 0;
+    free(iov);
+    ring->registered = err == 0;
+    return err;
+}
+
+int
+fr_read_batch(fring *ring, fr_read *reads, int count) {
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *) ring->sqes;
+    int done = 0;
+    int err = 0;
+
+    if (ring->failed) {
+        // The ring stopped working earlier, read synchronously
+        for (int i = 0; i < count; i++) {
+            reads[i].res = 0;
+        }
+        done = count;
+    }
+    while (done < count) {
+        int batch = count - done;
+        if ((unsigned) batch > ring->entries) {
+            batch = (int) ring->entries;
+        }
+
+        unsigned first = *ring->sq_tail;
+        unsigned tail = first;
+        for (int i = 0; i < batch; i++) {
+            fr_read *r = &reads[done + i];
+            unsigned slot = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &sqes[slot];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = ring->registered && r->buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = r->fd;
+            sqe->addr = (unsigned long) r->buf;
+            sqe->len = (unsigned) r->len;
+            sqe->off = (unsigned long long) r->off;
+            if (sqe->opcode == IORING_OP_READ_FIXED) {
+                sqe->buf_index = (unsigned short) r->buf_index;
+            }
+            sqe->user_data = (unsigned long long) (done + i);
+            ring->sq_array[slot] = slot;
+            r->res = -EINPROGRESS;
+            tail++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        int submitted = 0;
+        int completed = 0;
+        while (completed < batch) {
+            int ret = fr_sys_enter(ring->ring_fd, batch - submitted, 1, IORING_ENTER_GETEVENTS);
+            if (ret < 0 && errno != EINTR) {
+                // The rest of the batch and all later batches are read synchronously. Reads the
+                // kernel took may still write into their buffers, they are waited for first
+                err = errno;
+                ring->failed = 1;
+                submitted = (int) (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) - first);
+                completed += fr_reap(ring, reads);
+                while (completed < submitted) {
+                    ret = fr_sys_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+                    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                        break;
+                    }
+                    completed += fr_reap(ring, reads);
+                }
+                for (int i = done; i < count; i++) {
+                    if (i >= done + submitted) {
+                        reads[i].res = 0;
+                    } else if (reads[i].res == -EINPROGRESS) {
+                        reads[i].res = -err;
+                    }
+                }
+                done = count;
+                break;
+            }
+            if (ret > 0) {
+                submitted += ret;
+            }
+
+            completed += fr_reap(ring, reads);
+        }
+        if (!ring->failed) {
+            done += batch;
+        }
+    }
+
+    // A read may stop short of the end of file, the rest is read synchronously
+    for (int i = 0; i < count; i++) {
+        fr_read *r = &reads[i];
+        while (r->res >= 0 && (size_t) r->res < r->len) {
+            ssize_t cnt = pread(r->fd, r->buf + r->res, r->len - r->res, r->off + r->res);
+            if (cnt < 0 && errno == EINTR) {
+                continue;
+            }
+            if (cnt < 0) {
+                r->res = -errno;
+            } else if (cnt == 0) {
+                break;
+            } else {
+                r->res += cnt;
+            }
+        }
+    }
+    return err;
+}
+
+void
+fr_free(fring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+    }
+    memset(ring, 0, sizeof(fring));
+    ring->ring_fd = -1;
+}
+
+#else
+
+int
+fr_init(fring *ring, unsigned entries) {
+    (void) entries;
+    memset(ring, 0, sizeof(fring));
+    ring->ring_fd = -1;
+    return ENOSYS;
+}
+
+int
+fr_register_buffers(fring *ring, char **bufs, int count, size_t size) {
+    (void) ring;
+    (void) bufs;
+    (void) count;
+    (void) size;
+    return ENOSYS;
+}
+
+int
+fr_read_batch(fring *ring, fr_read *reads, int count) {
+    (void) ring;
+    for (int i = 0; i < count; i++) {
+        reads[i].res = -ENOSYS;
+    }
+    return ENOSYS;
+}
+
+void
+fr_free(fring *ring) {
+    (void) ring;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef _FRING_H
+#define _FRING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Batched positional reads through io_uring (Linux only).
+ * A batch of reads is submitted with one system call and waited for as a whole,
+ * so the device sees all reads of a comparison pass at once.
+ */
+
+typedef struct fr_read {
+    int fd;             // file to read from
+    char *buf;          // destination buffer
+    size_t len;         // number of bytes to read
+    off_t off;          // file offset
+    int buf_index;      // index of registered buffer holding buf, -1 if not registered
+    ssize_t res;        // bytes read or -errno, filled by fr_read_batch
+} fr_read;
+
+typedef struct fring {
+    int ring_fd;
+    unsigned entries;
+    int registered;     // buffers were registered with fr_register_buffers
+    int failed;         // submission failed, reads fall back to pread
+
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    void *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+} fring;
+
+/**
+ * Set up a ring.
+ * @param ring ring to initialize
+ * @param entries submission queue size, the largest batch fr_read_batch submits at once
+ * @return 0 on success, errno value when io_uring is not available (ENOSYS on other systems and
+ *         on kernels without IORING_OP_READ, before Linux 5.6)
+ */
+int fr_init(fring *ring, unsigned entries);
+
+/**
+ * Register read buffers, reads into them then use fixed buffers.
+ * @param ring ring
+ * @param bufs array of buffers
+ * @param count number of buffers
+ * @param size size of every buffer
+ * @return 0 on success, errno value on failure (reads still work with unregistered buffers)
+ */
+int fr_register_buffers(fring *ring, char **bufs, int count, size_t size);
+
+/**
+ * Submit reads and wait until all of them complete. Batches larger than the
+ * ring are split and short reads are completed synchronously. res of each read is filled in.
+ * Reads the ring rejects (EINVAL, EOPNOTSUPP) are done with pread. Once submission
+ * fails, the reads the kernel took are waited for, and the others and all later reads
+ * are done with pread.
+ * @param ring ring
+ * @param reads array of reads
+ * @param count number of reads
+ * @return 0 on success, errno value when the ring failed during this call
+ *         (res of reads still in flight when waiting for them failed too is -errno)
+ */
+int fr_read_batch(fring *ring, fr_read *reads, int count);
+
+/**
+ * Release the ring.
+ * @param ring ring
+ */
+void fr_free(fring *ring);
+
+#endif
@@ -0,0 +1,243 @@
+#include "wspool.h"
+#include "salloc.h"
+#include <errno.h>
+#include <unistd.h>
+
+#define WSPOOL_INITIAL_CAPACITY 64
+
+typedef struct {
+    wspool *pool;
+    int worker;
+} wspool_thread_arg;
+
+/**
+ * Push task to the tail (owner end) of a deque, growing it when full.
+ * @param dq deque
+ * @param task task pointer
+ * @return 0 on success, ENOMEM on failure
+ */
+static int
+wspool_deque_push(wspool_deque *dq, void *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->capacity) {
+        size_t new_capacity = dq->capacity ? dq->capacity * 2 : WSPOOL_INITIAL_CAPACITY;
+        void **tasks = (void **) salloc(sizeof(void *) * new_capacity, NULL);
+        if (!tasks) {
+            pthread_mutex_unlock(&dq->lock);
+            return ENOMEM;
+        }
+        for (size_t i = dq->head; i < dq->tail; i++) {
+            tasks[i - dq->head] = dq->tasks[i & (dq->capacity - 1)];
+        }
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->tail -= dq->head;
+        dq->head = 0;
+        dq->capacity = new_capacity;
+    }
+    dq->tasks[dq->tail & (dq->capacity - 1)] = task;
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/**
+ * Pop newest task of a deque (owner side).
+ */
+static void *
+wspool_deque_pop(wspool_deque *dq) {
+    void *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        dq->tail--;
+        task = dq->tasks[dq->tail & (dq->capacity - 1)];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/**
+ * Take oldest task of a deque (thief side).
+ */
+static void *
+wspool_deque_steal(wspool_deque *dq) {
+    void *task = NULL;
+    // The lock is held for a few instructions, waiting for it beats reporting a busy deque
+    // as empty: the thief would go to sleep with tasks left
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        task = dq->tasks[dq->head & (dq->capacity - 1)];
+        dq->head++;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/**
+ * Find work for a worker: own deque first, then steal starting at a random victim.
+ */
+static void *
+wspool_find_task(wspool *pool, int worker, unsigned int *seed) {
+    void *task = wspool_deque_pop(&pool->deques[worker]);
+    if (task != NULL || pool->nworkers == 1) {
+        return task;
+    }
+    *seed = *seed * 1103515245u + 12345u;
+    int start = (int) ((*seed >> 16) % (unsigned int) pool->nworkers);
+    for (int i = 0; i < pool->nworkers; i++) {
+        int victim = (start + i) % pool->nworkers;
+        if (victim == worker) {
+            continue;
+        }
+        task = wspool_deque_steal(&pool->deques[victim]);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void
+wspool_loop(wspool *pool, int worker) {
+    unsigned int seed = (unsigned int) worker * 2654435761u + 1u;
+
+    for (;;) {
+        size_t seen_seq = __atomic_load_n(&pool->submit_seq, __ATOMIC_ACQUIRE);
+        void *task = wspool_find_task(pool, worker, &seed);
+        if (task != NULL) {
+            pool->fn(pool, worker, task, pool->ctx);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+
+        int done;
+        pthread_mutex_lock(&pool->idle_lock);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) != 0 && pool->submit_seq == seen_seq) {
+            pool->sleepers++;
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            pool->sleepers--;
+        }
+        done = __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (done) {
+            return;
+        }
+    }
+}
+
+static void *
+wspool_thread(void *arg) {
+    wspool_thread_arg *ta = (wspool_thread_arg *) arg;
+    wspool_loop(ta->pool, ta->worker);
+    return NULL;
+}
+
+int
+wspool_init(wspool *pool, int nworkers, wspool_fn fn, void *ctx) {
+    if (nworkers <= 0 || fn == NULL) {
+        return EINVAL;
+    }
+    pool->nworkers = nworkers;
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->pending = 0;
+    pool->submit_seq = 0;
+    pool->sleepers = 0;
+    pool->deques = (wspool_deque *) salloc(sizeof(wspool_deque) * nworkers, NULL);
+    if (!pool->deques) {
+        return ENOMEM;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].tasks = NULL;
+        pool->deques[i].capacity = 0;
+        pool->deques[i].head = 0;
+        pool->deques[i].tail = 0;
+    }
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    return 0;
+}
+
+int
+wspool_submit(wspool *pool, int worker, void *task) {
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    int ret = wspool_deque_push(&pool->deques[worker % pool->nworkers], task);
+    if (ret != 0) {
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+        return ret;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    __atomic_add_fetch(&pool->submit_seq, 1, __ATOMIC_RELEASE);
+    if (pool->sleepers > 0) {
+        pthread_cond_signal(&pool->idle_cond);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+    return 0;
+}
+
+int
+wspool_run(wspool *pool) {
+    int ret = 0;
+    int started = 0;
+    pthread_t *threads = NULL;
+    wspool_thread_arg *args = NULL;
+
+    if (pool->nworkers > 1) {
+        threads = (pthread_t *) salloc(sizeof(pthread_t) * pool->nworkers, NULL);
+        args = (wspool_thread_arg *) salloc(sizeof(wspool_thread_arg) * pool->nworkers, NULL);
+        if (!threads || !args) {
+            ret = ENOMEM; // still drain the pool on the calling thread
+        }
+    }
+    if (threads && args) {
+        for (int i = 1; i < pool->nworkers; i++) {
+            args[i].pool = pool;
+            args[i].worker = i;
+            ret = pthread_create(&threads[i], NULL, wspool_thread, &args[i]);
+            if (ret != 0) {
+                break;
+            }
+            started = i;
+        }
+    }
+
+    wspool_loop(pool, 0);
+
+    for (int i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(args);
+    return ret;
+}
+
+void
+wspool_free(wspool *pool) {
+    if (!pool->deques) {
+        return;
+    }
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    free(pool->deques);
+    pool->deques = NULL;
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+}
+
+int
+wspool_cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0) {
+        return n > 1024 ? 1024 : (int) n;
+    }
+#endif
+    return 1;
+}
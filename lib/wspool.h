@@ -0,0 +1,88 @@
+#ifndef _WSPOOL_H
+#define _WSPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Work-stealing task pool.
+ *
+ * Every worker owns a deque of opaque task pointers. A worker pushes and pops
+ * its own tasks LIFO (depth first, cache friendly) and, when its deque runs
+ * dry, steals the oldest task from another worker. wspool_run() returns once
+ * every submitted task, including tasks submitted by other tasks, has finished.
+ */
+
+typedef struct wspool wspool;
+
+/**
+ * Task handler.
+ * @param pool pool the task runs in; handlers may wspool_submit() new tasks
+ * @param worker index of the worker running the task (0 .. nworkers-1)
+ * @param task task pointer as passed to wspool_submit()
+ * @param ctx context pointer given to wspool_init()
+ */
+typedef void (*wspool_fn)(wspool *pool, int worker, void *task, void *ctx);
+
+typedef struct wspool_deque {
+    pthread_mutex_t lock;
+    void **tasks;
+    size_t capacity;
+    size_t head;    // oldest task, stolen by other workers
+    size_t tail;    // one past the newest task, popped by the owner
+} wspool_deque;
+
+struct wspool {
+    int nworkers;
+    wspool_fn fn;
+    void *ctx;
+    wspool_deque *deques;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    size_t pending;     // submitted and not yet finished tasks
+    size_t submit_seq;  // bumped on every submit, wakes sleeping workers
+    int sleepers;
+};
+
+/**
+ * Initialize pool.
+ * @param pool pool to initialize
+ * @param nworkers number of workers (the thread calling wspool_run() is worker 0)
+ * @param fn task handler
+ * @param ctx context passed to every handler call
+ * @return 0 on success, ENOMEM or EINVAL on failure
+ */
+int wspool_init(wspool *pool, int nworkers, wspool_fn fn, void *ctx);
+
+/**
+ * Submit task.
+ * @param pool pool
+ * @param worker deque to push to; a handler passes its own worker index,
+ *        callers outside of wspool_run() may pass any index (e.g. round-robin)
+ * @param task task pointer handed to the handler
+ * @return 0 on success, ENOMEM if the deque could not grow
+ */
+int wspool_submit(wspool *pool, int worker, void *task);
+
+/**
+ * Run all submitted tasks and wait until the pool is drained.
+ * Spawns nworkers-1 threads, the calling thread acts as worker 0.
+ * @param pool pool
+ * @return 0 on success, error code of pthread_create otherwise
+ *         (remaining work is then done by the threads that did start)
+ */
+int wspool_run(wspool *pool);
+
+/**
+ * Free pool. Tasks still queued are dropped without calling the handler.
+ * @param pool pool
+ */
+void wspool_free(wspool *pool);
+
+/**
+ * Number of online processors, at least 1.
+ */
+int wspool_cpu_count(void);
+
+#endif
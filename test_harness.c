@@ -5,6 +5,17 @@
 
 // Assuming fcompare.h is accessible via -I./lib
 #include "fcompare.h"
+#include "blkcmp.h"
+#include "fmanage.h"
+#include "wspool.h"
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 // Structure to hold results from async callback for verification
 typedef struct {
@@ -32,6 +43,23 @@ void async_test_callback(const DuplicateSet *duplicates, void *user_data) {
     }
 }
 
+// Context for checking DuplicateSet.indices against the input array
+typedef struct {
+    char **files;
+    int sets_found;
+    int indices_ok;
+} IndicesTestContext;
+
+void indices_test_callback(const DuplicateSet *duplicates, void *user_data) {
+    IndicesTestContext *ctx = (IndicesTestContext *)user_data;
+    ctx->sets_found++;
+    for (int i = 0; i < duplicates->count; i++) {
+        if (duplicates->indices == NULL || strcmp(duplicates->paths[i], ctx->files[duplicates->indices[i]]) != 0) {
+            ctx->indices_ok = 0;
+        }
+    }
+}
+
 // Helper to create a dummy file with specific content
 void create_dummy_file(const char *filename, const char *content) {
     FILE *fp = fopen(filename, "w");
@@ -57,6 +85,88 @@ void create_dummy_file_with_size(const char *filename, const char *content, int
 }
 
 
+// Second name of a file, which shares all its extents; a copy where links are not available
+void create_link(const char *target, const char *filename, const char *content, int size) {
+#ifndef _WIN32
+    if (link(target, filename) == 0) {
+        return;
+    }
+#endif
+    (void) target;
+    create_dummy_file_with_size(filename, content, size);
+}
+
+// File of size bytes holding data at the given offsets and holes elsewhere (where supported)
+void create_sparse_file(const char *filename, long size, const long *offsets, int count, char value) {
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    char block[4096];
+    memset(block, value, sizeof(block));
+    for (int i = 0; i < count; i++) {
+        fseek(f, offsets[i], SEEK_SET);
+        fwrite(block, 1, sizeof(block), f);
+    }
+    fseek(f, size - 1, SEEK_SET);
+    fputc(0, f);
+    fclose(f);
+}
+
+// Groups compared by a pool of workers sharing one buffer budget, as equalff does
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t buffer_free;
+    int holding;        // groups holding their share of the buffer
+    int max_holding;    // most groups that held their share at once
+    char **paths[2];
+    int count;
+    CompareOptions options;
+    AsyncTestContext found[2];
+    int ret[2];
+} BudgetTestContext;
+
+void budget_test_task(wspool *pool, int worker, void *task, void *ctx) {
+    (void) pool;
+    (void) worker;
+    BudgetTestContext *bt = (BudgetTestContext *) ctx;
+    int group = *(int *) task;
+    size_t buffer = compare_group_buffer(&bt->options, (size_t) bt->count, 2);
+
+    pthread_mutex_lock(&bt->lock);
+    while (bt->buffer_free < buffer) {
+        pthread_cond_wait(&bt->cond, &bt->lock);
+    }
+    bt->buffer_free -= buffer;
+    bt->holding++;
+    if (bt->holding > bt->max_holding) {
+        bt->max_holding = bt->holding;
+    }
+    pthread_cond_broadcast(&bt->cond);
+    // Give the other group a few seconds to start alongside
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    while (bt->max_holding < 2 && pthread_cond_timedwait(&bt->cond, &bt->lock, &deadline) == 0) {
+    }
+    pthread_mutex_unlock(&bt->lock);
+
+    CompareOptions opt = bt->options;
+    opt.max_buffer = (int) buffer;
+    char *error_msg = NULL;
+    bt->ret[group] = compare_files_async_opts(bt->paths[group], bt->count, &opt, async_test_callback,
+                                              &bt->found[group], &error_msg);
+    if (error_msg) free_error_message(error_msg);
+
+    pthread_mutex_lock(&bt->lock);
+    bt->buffer_free += buffer;
+    bt->holding--;
+    pthread_cond_broadcast(&bt->cond);
+    pthread_mutex_unlock(&bt->lock);
+}
+
 void print_result(ComparisonResult *result, const char* test_name) {
     printf("--- Test: %s ---\n", test_name);
     if (result == NULL) {
@@ -343,6 +453,791 @@ int main() {
     result = NULL;
     printf("--------------------\n\n");
 
+    // --- Test Case 16: Async: indices of duplicate paths point into the input array ---
+    printf("--- Test: Async: Duplicate set indices ---\n");
+    create_dummy_file("test16_fileA.txt", "Index me");
+    create_dummy_file("test16_fileB.txt", "Other one");
+    create_dummy_file("test16_fileC.txt", "Index me");
+    create_dummy_file("test16_fileD.txt", "Other one");
+    char *test16_files[] = {"test16_fileA.txt", "test16_fileB.txt", "test16_fileC.txt", "test16_fileD.txt"};
+    IndicesTestContext indices_ctx = {test16_files, 0, 1};
+    char *error_msg_16 = NULL;
+    int ret_16 = compare_files_async(test16_files, 4, 1024 * 1024, 10, indices_test_callback, &indices_ctx, &error_msg_16);
+    if (ret_16 != 0) {
+        printf("ERROR (%d): %s\n", ret_16, error_msg_16 ? error_msg_16 : "No error message.");
+        if (error_msg_16) free_error_message(error_msg_16);
+    } else if (indices_ctx.sets_found == 2 && indices_ctx.indices_ok) {
+        printf("Verification: PASSED (2 sets, indices match paths)\n");
+    } else {
+        printf("Verification: FAILED (Expected 2 sets with matching indices, got %d sets, indices %s)\n",
+               indices_ctx.sets_found, indices_ctx.indices_ok ? "ok" : "wrong");
+    }
+    remove("test16_fileA.txt");
+    remove("test16_fileB.txt");
+    remove("test16_fileC.txt");
+    remove("test16_fileD.txt");
+    printf("--------------------\n\n");
+
+    // --- Test Case 17: Async: mmap engine, in place and with more files than mappings ---
+    printf("--- Test: Async: mmap engine ---\n");
+    create_dummy_file("test17_fileA.txt", "Mapped content, same tail");
+    create_dummy_file("test17_fileB.txt", "Mapped content, other end");
+    create_dummy_file("test17_fileC.txt", "Mapped content, same tail");
+    create_dummy_file("test17_fileD.txt", "Mapped content, other end");
+    char *test17_files[] = {"test17_fileA.txt", "test17_fileB.txt", "test17_fileC.txt", "test17_fileD.txt"};
+    int test17_limits[] = {10, 1};
+    for (int t = 0; t < 2; t++) {
+        CompareOptions opts_17;
+        init_compare_options(&opts_17);
+        opts_17.max_buffer = 1024 * 1024;
+        opts_17.max_open_files = test17_limits[t];
+        opts_17.engine = COMPARE_ENGINE_MMAP;
+        IndicesTestContext mmap_ctx = {test17_files, 0, 1};
+        char *error_msg_17 = NULL;
+        int ret_17 = compare_files_async_opts(test17_files, 4, &opts_17, indices_test_callback, &mmap_ctx, &error_msg_17);
+        if (ret_17 != 0) {
+            printf("ERROR (%d): %s\n", ret_17, error_msg_17 ? error_msg_17 : "No error message.");
+            if (error_msg_17) free_error_message(error_msg_17);
+        } else if (mmap_ctx.sets_found == 2 && mmap_ctx.indices_ok) {
+            printf("Verification: PASSED (2 sets with max_open_files %d)\n", test17_limits[t]);
+        } else {
+            printf("Verification: FAILED (Expected 2 sets with max_open_files %d, got %d)\n",
+                   test17_limits[t], mmap_ctx.sets_found);
+        }
+    }
+    remove("test17_fileA.txt");
+    remove("test17_fileB.txt");
+    remove("test17_fileC.txt");
+    remove("test17_fileD.txt");
+    printf("--------------------\n\n");
+
+    // --- Test Case 18: Async: io_uring engine (read engine where io_uring is unavailable) ---
+    printf("--- Test: Async: uring engine ---\n");
+    create_dummy_file("test18_fileA.txt", "Batched content, same tail");
+    create_dummy_file("test18_fileB.txt", "Batched content, other end");
+    create_dummy_file("test18_fileC.txt", "Batched content, same tail");
+    create_dummy_file("test18_fileD.txt", "Batched content, other end");
+    char *test18_files[] = {"test18_fileA.txt", "test18_fileB.txt", "test18_fileC.txt", "test18_fileD.txt"};
+    int test18_limits[] = {10, 1};
+    for (int t = 0; t < 2; t++) {
+        CompareOptions opts_18;
+        init_compare_options(&opts_18);
+        opts_18.max_buffer = 1024 * 1024;
+        opts_18.max_open_files = test18_limits[t];
+        opts_18.engine = COMPARE_ENGINE_URING;
+        IndicesTestContext uring_ctx = {test18_files, 0, 1};
+        char *error_msg_18 = NULL;
+        int ret_18 = compare_files_async_opts(test18_files, 4, &opts_18, indices_test_callback, &uring_ctx, &error_msg_18);
+        if (ret_18 != 0) {
+            printf("ERROR (%d): %s\n", ret_18, error_msg_18 ? error_msg_18 : "No error message.");
+            if (error_msg_18) free_error_message(error_msg_18);
+        } else if (uring_ctx.sets_found == 2 && uring_ctx.indices_ok) {
+            printf("Verification: PASSED (2 sets with max_open_files %d)\n", test18_limits[t]);
+        } else {
+            printf("Verification: FAILED (Expected 2 sets with max_open_files %d, got %d)\n",
+                   test18_limits[t], uring_ctx.sets_found);
+        }
+    }
+    remove("test18_fileA.txt");
+    remove("test18_fileB.txt");
+    remove("test18_fileC.txt");
+    remove("test18_fileD.txt");
+    printf("--------------------\n\n");
+
+    // --- Test Case 19: Async: tail and middle probes before the forward sweep ---
+    printf("--- Test: Async: probe stage ---\n");
+    int test19_size = 200000;
+    char *test19_content = (char *)malloc(test19_size);
+    for (int i = 0; i < test19_size; i++) {
+        test19_content[i] = (char)(i * 7 + i / 251);
+    }
+    create_dummy_file_with_size("test19_fileA.bin", test19_content, test19_size);
+    create_dummy_file_with_size("test19_fileB.bin", test19_content, test19_size);
+    test19_content[test19_size - 1] ^= 1; // differs in the tail
+    create_dummy_file_with_size("test19_fileC.bin", test19_content, test19_size);
+    test19_content[test19_size - 1] ^= 1;
+    test19_content[test19_size / 2] ^= 1; // differs in the middle
+    create_dummy_file_with_size("test19_fileD.bin", test19_content, test19_size);
+    test19_content[test19_size / 2] ^= 1;
+    create_dummy_file_with_size("test19_fileE.bin", test19_content, test19_size);
+    free(test19_content);
+    char *test19_files[] = {"test19_fileA.bin", "test19_fileB.bin", "test19_fileC.bin", "test19_fileD.bin", "test19_fileE.bin"};
+    CompareOptions opts_19;
+    init_compare_options(&opts_19);
+    opts_19.max_buffer = 1024 * 1024;
+    opts_19.probe_tail = 1;
+    opts_19.probe_samples = 3;
+    AsyncTestContext probe_ctx = {0, 0};
+    char *error_msg_19 = NULL;
+    int ret_19 = compare_files_async_opts(test19_files, 5, &opts_19, async_test_callback, &probe_ctx, &error_msg_19);
+    if (ret_19 != 0) {
+        printf("ERROR (%d): %s\n", ret_19, error_msg_19 ? error_msg_19 : "No error message.");
+        if (error_msg_19) free_error_message(error_msg_19);
+    } else if (probe_ctx.sets_found == 1 && probe_ctx.total_files_in_sets == 3) {
+        printf("Verification: PASSED (1 set of 3 files found)\n");
+    } else {
+        printf("Verification: FAILED (Expected 1 set of 3 files, got %d sets with %d files)\n",
+               probe_ctx.sets_found, probe_ctx.total_files_in_sets);
+    }
+    remove("test19_fileA.bin");
+    remove("test19_fileB.bin");
+    remove("test19_fileC.bin");
+    remove("test19_fileD.bin");
+    remove("test19_fileE.bin");
+    printf("--------------------\n\n");
+
+    // --- Test Case 20: Block mismatch kernel against a byte loop ---
+    printf("--- Test: blk_mismatch (%s) ---\n", blk_kernel_name());
+    unsigned char test20_a[300];
+    unsigned char test20_b[300];
+    int test20_failures = 0;
+    for (int i = 0; i < 300; i++) {
+        test20_a[i] = (unsigned char)(i * 13);
+    }
+    for (size_t len = 0; len <= 300; len += 7) {
+        for (size_t pos = 0; pos <= len; pos++) {
+            memcpy(test20_b, test20_a, sizeof(test20_b));
+            if (pos < len) {
+                test20_b[pos] ^= 0x80;
+            }
+            size_t expected = len;
+            for (size_t k = 0; k < len; k++) {
+                if (test20_a[k] != test20_b[k]) {
+                    expected = k;
+                    break;
+                }
+            }
+            int expected_cmp = memcmp(test20_a, test20_b, len);
+            int got_cmp = blk_compare(test20_a, test20_b, len, NULL);
+            if (blk_mismatch(test20_a, test20_b, len) != expected
+                || (expected_cmp < 0) != (got_cmp < 0) || (expected_cmp > 0) != (got_cmp > 0)) {
+                test20_failures++;
+            }
+        }
+    }
+    if (test20_failures == 0) {
+        printf("Verification: PASSED (mismatch offsets and ordering match memcmp)\n");
+    } else {
+        printf("Verification: FAILED (%d mismatching cases)\n", test20_failures);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 21: Async: large group split into several classes in one pass ---
+    printf("--- Test: Async: many files, three classes ---\n");
+    char *test21_files[30];
+    char test21_content[2000];
+    for (int i = 0; i < 30; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test21_file%02d.bin", i);
+        test21_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test21_content); k++) {
+            test21_content[k] = (char)(k * 3);
+        }
+        test21_content[1000 + i % 3] = 'x'; // class by i % 3, differing between sampled words
+        create_dummy_file_with_size(test21_files[i], test21_content, sizeof(test21_content));
+    }
+    AsyncTestContext classes_ctx = {0, 0};
+    char *error_msg_21 = NULL;
+    int ret_21 = compare_files_async(test21_files, 30, 64 * 1024, 10, async_test_callback, &classes_ctx, &error_msg_21);
+    if (ret_21 != 0) {
+        printf("ERROR (%d): %s\n", ret_21, error_msg_21 ? error_msg_21 : "No error message.");
+        if (error_msg_21) free_error_message(error_msg_21);
+    } else if (classes_ctx.sets_found == 3 && classes_ctx.total_files_in_sets == 30) {
+        printf("Verification: PASSED (3 sets of 10 files found)\n");
+    } else {
+        printf("Verification: FAILED (Expected 3 sets with 30 files, got %d sets with %d files)\n",
+               classes_ctx.sets_found, classes_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 30; i++) {
+        remove(test21_files[i]);
+        free(test21_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 22: Batched pair comparison ---
+    printf("--- Test: compare_pairs_async ---\n");
+    create_dummy_file("test22_fileA.txt", "Pair content");
+    create_dummy_file("test22_fileB.txt", "Pair content");
+    create_dummy_file("test22_fileC.txt", "Pair contenT");
+    char *test22_pairs[] = {"test22_fileA.txt", "test22_fileB.txt",
+                            "test22_fileA.txt", "test22_fileC.txt",
+                            "test22_fileA.txt", "non_existent_file22.txt",
+                            "test22_fileB.txt", "test22_fileA.txt"};
+    AsyncTestContext pairs_ctx = {0, 0};
+    char *error_msg_22 = NULL;
+    int ret_22 = compare_pairs_async(test22_pairs, 4, NULL, async_test_callback, &pairs_ctx, &error_msg_22);
+    if (ret_22 == ENOENT && pairs_ctx.sets_found == 2 && pairs_ctx.total_files_in_sets == 4) {
+        printf("Verification: PASSED (2 equal pairs, missing file reported: %s)\n", error_msg_22 ? error_msg_22 : "");
+    } else {
+        printf("Verification: FAILED (Expected ENOENT and 2 pairs, got %d and %d sets with %d files)\n",
+               ret_22, pairs_ctx.sets_found, pairs_ctx.total_files_in_sets);
+    }
+    if (error_msg_22) free_error_message(error_msg_22);
+    remove("test22_fileA.txt");
+    remove("test22_fileB.txt");
+    remove("test22_fileC.txt");
+    printf("--------------------\n\n");
+
+    // --- Test Case 23: Async: clusters of a split group compared by several threads ---
+    printf("--- Test: Async: clusters compared in parallel ---\n");
+    char *test23_files[40];
+    char test23_content[20000];
+    for (int i = 0; i < 40; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test23_file%02d.bin", i);
+        test23_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test23_content); k++) {
+            test23_content[k] = (char)(k * 7);
+        }
+        test23_content[0] = (char) ('a' + i % 4);       // four clusters after the first block
+        test23_content[15000] = (char) ('a' + i % 8);   // each split in two far past it
+        create_dummy_file_with_size(test23_files[i], test23_content, sizeof(test23_content));
+    }
+    CompareOptions parallel_opt;
+    init_compare_options(&parallel_opt);
+    parallel_opt.max_buffer = 1024 * 1024;
+    parallel_opt.max_open_files = 8;
+    parallel_opt.threads = 4;
+    AsyncTestContext parallel_ctx = {0, 0};
+    char *error_msg_23 = NULL;
+    int ret_23 = compare_files_async_opts(test23_files, 40, &parallel_opt, async_test_callback, &parallel_ctx,
+                                          &error_msg_23);
+    if (ret_23 != 0) {
+        printf("ERROR (%d): %s\n", ret_23, error_msg_23 ? error_msg_23 : "No error message.");
+        if (error_msg_23) free_error_message(error_msg_23);
+    } else if (parallel_ctx.sets_found == 8 && parallel_ctx.total_files_in_sets == 40) {
+        printf("Verification: PASSED (8 sets of 5 files found)\n");
+    } else {
+        printf("Verification: FAILED (Expected 8 sets with 40 files, got %d sets with %d files)\n",
+               parallel_ctx.sets_found, parallel_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 40; i++) {
+        remove(test23_files[i]);
+        free(test23_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 24: Async: more files than the buffer holds, split by hashes first ---
+    printf("--- Test: Async: group larger than the buffer ---\n");
+    char *test24_files[15];
+    char test24_content[3000];
+    for (int i = 0; i < 15; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test24_file%02d.bin", i);
+        test24_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test24_content); k++) {
+            test24_content[k] = (char)(k * 5);
+        }
+        // 10 equal files (more than one bucket may hold), 4 equal files and a unique one
+        test24_content[2500] = (char) (i < 10 ? 'a' : i < 14 ? 'b' : 'c');
+        create_dummy_file_with_size(test24_files[i], test24_content, sizeof(test24_content));
+    }
+    AsyncTestContext large_ctx = {0, 0};
+    char *error_msg_24 = NULL;
+    int ret_24 = compare_files_async(test24_files, 15, 1024, 10, async_test_callback, &large_ctx, &error_msg_24);
+    if (ret_24 != 0) {
+        printf("ERROR (%d): %s\n", ret_24, error_msg_24 ? error_msg_24 : "No error message.");
+        if (error_msg_24) free_error_message(error_msg_24);
+    } else if (large_ctx.sets_found == 2 && large_ctx.total_files_in_sets == 14) {
+        printf("Verification: PASSED (sets of 10 and 4 files found with a 1024 bytes buffer)\n");
+    } else {
+        printf("Verification: FAILED (Expected 2 sets with 14 files, got %d sets with %d files)\n",
+               large_ctx.sets_found, large_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 15; i++) {
+        remove(test24_files[i]);
+        free(test24_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 25: Async: more files than may be open, more classes than kept per pass ---
+    printf("--- Test: Async: group larger than the open files limit ---\n");
+    char *test25_files[24];
+    char test25_content[16000];
+    for (int i = 0; i < 24; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test25_file%02d.bin", i);
+        test25_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test25_content); k++) {
+            test25_content[k] = (char)(k * 11);
+        }
+        test25_content[10000] = (char) ('a' + i % 12);  // 12 pairs, told apart past the first block
+        create_dummy_file_with_size(test25_files[i], test25_content, sizeof(test25_content));
+    }
+    AsyncTestContext limit_ctx = {0, 0};
+    char *error_msg_25 = NULL;
+    int ret_25 = compare_files_async(test25_files, 24, 64 * 1024, 4, async_test_callback, &limit_ctx, &error_msg_25);
+    if (ret_25 != 0) {
+        printf("ERROR (%d): %s\n", ret_25, error_msg_25 ? error_msg_25 : "No error message.");
+        if (error_msg_25) free_error_message(error_msg_25);
+    } else if (limit_ctx.sets_found == 12 && limit_ctx.total_files_in_sets == 24) {
+        printf("Verification: PASSED (12 pairs found with 4 open files)\n");
+    } else {
+        printf("Verification: FAILED (Expected 12 sets with 24 files, got %d sets with %d files)\n",
+               limit_ctx.sets_found, limit_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 24; i++) {
+        remove(test25_files[i]);
+        free(test25_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 26: Async: files read in the order of their data on the disk ---
+    printf("--- Test: Async: seek ordered reads ---\n");
+    char *test26_files[12];
+    char test26_content[200000];
+    for (int i = 0; i < 12; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test26_file%02d.bin", i);
+        test26_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test26_content); k++) {
+            test26_content[k] = (char)(k * 13);
+        }
+        test26_content[150000] = (char) ('a' + i % 3);  // 3 sets, told apart after several blocks
+        test26_content[100] = (char) (i == 11 ? 'z' : 0);
+        create_dummy_file_with_size(test26_files[i], test26_content, sizeof(test26_content));
+    }
+    CompareOptions seek_opt;
+    init_compare_options(&seek_opt);
+    seek_opt.max_buffer = 256 * 1024;
+    seek_opt.seek_order = 1;
+    AsyncTestContext seek_ctx = {0, 0};
+    char *error_msg_26 = NULL;
+    int ret_26 = compare_files_async_opts(test26_files, 12, &seek_opt, async_test_callback, &seek_ctx,
+                                          &error_msg_26);
+    if (ret_26 != 0) {
+        printf("ERROR (%d): %s\n", ret_26, error_msg_26 ? error_msg_26 : "No error message.");
+        if (error_msg_26) free_error_message(error_msg_26);
+    } else if (seek_ctx.sets_found == 3 && seek_ctx.total_files_in_sets == 11) {
+        printf("Verification: PASSED (3 sets found reading in disk order)\n");
+    } else {
+        printf("Verification: FAILED (Expected 3 sets with 11 files, got %d sets with %d files)\n",
+               seek_ctx.sets_found, seek_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 12; i++) {
+        remove(test26_files[i]);
+        free(test26_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 27: Async: files sharing their extents merged before reading ---
+    printf("--- Test: Async: shared extents ---\n");
+    char *test27_files[6] = {"test27_a.bin", "test27_b.bin", "test27_c.bin", "test27_d.bin", "test27_e.bin",
+                             "test27_f.bin"};
+    char test27_content[20000];
+    memset(test27_content, 'x', sizeof(test27_content));
+    create_dummy_file_with_size(test27_files[0], test27_content, sizeof(test27_content));
+    create_link(test27_files[0], test27_files[1], test27_content, sizeof(test27_content));
+    create_dummy_file_with_size(test27_files[2], test27_content, sizeof(test27_content));   // same data, own extents
+    test27_content[15000] = 'y';
+    create_dummy_file_with_size(test27_files[4], test27_content, sizeof(test27_content));
+    create_link(test27_files[4], test27_files[3], test27_content, sizeof(test27_content));
+    test27_content[15000] = 'z';
+    create_dummy_file_with_size(test27_files[5], test27_content, sizeof(test27_content));
+    CompareOptions shared_opt;
+    init_compare_options(&shared_opt);
+    shared_opt.shared_extents = 1;
+    AsyncTestContext shared_ctx = {0, 0};
+    char *error_msg_27 = NULL;
+    int ret_27 = compare_files_async_opts(test27_files, 6, &shared_opt, async_test_callback, &shared_ctx,
+                                          &error_msg_27);
+    AsyncTestContext shared_pair_ctx = {0, 0};
+    char *error_msg_27p = NULL;
+    if (ret_27 == 0) {
+        ret_27 = compare_files_async_opts(&test27_files[3], 2, &shared_opt, async_test_callback, &shared_pair_ctx,
+                                          &error_msg_27p);
+    }
+    if (ret_27 != 0) {
+        char *msg = error_msg_27 ? error_msg_27 : error_msg_27p;
+        printf("ERROR (%d): %s\n", ret_27, msg ? msg : "No error message.");
+        if (error_msg_27) free_error_message(error_msg_27);
+        if (error_msg_27p) free_error_message(error_msg_27p);
+    } else if (shared_ctx.sets_found == 2 && shared_ctx.total_files_in_sets == 5
+               && shared_pair_ctx.sets_found == 1 && shared_pair_ctx.total_files_in_sets == 2) {
+        printf("Verification: PASSED (sets of 3 and 2 files found, linked pair found)\n");
+    } else {
+        printf("Verification: FAILED (Expected 2 sets with 5 files and a pair, got %d sets with %d files and %d pairs)\n",
+               shared_ctx.sets_found, shared_ctx.total_files_in_sets, shared_pair_ctx.sets_found);
+    }
+    for (int i = 0; i < 6; i++) {
+        remove(test27_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 28: Async: sparse files, holes equal to written zeros ---
+    printf("--- Test: Async: sparse files ---\n");
+    char *test28_files[5] = {"test28_a.bin", "test28_b.bin", "test28_c.bin", "test28_d.bin", "test28_e.bin"};
+    long test28_data[2] = {0, 6L * 1024 * 1024};
+    long test28_zero[1] = {3L * 1024 * 1024};
+    create_sparse_file(test28_files[0], 8L * 1024 * 1024, test28_data, 2, 'x');
+    create_sparse_file(test28_files[1], 8L * 1024 * 1024, test28_data, 2, 'x');
+    create_sparse_file(test28_files[2], 8L * 1024 * 1024, test28_data, 2, 'y');
+    create_sparse_file(test28_files[3], 8L * 1024 * 1024, test28_data, 2, 'x');
+    {
+        // Zeros written where the others have a hole
+        FILE *f = fopen(test28_files[3], "r+b");
+        char zeros[4096] = {0};
+        fseek(f, test28_zero[0], SEEK_SET);
+        fwrite(zeros, 1, sizeof(zeros), f);
+        fclose(f);
+    }
+    create_sparse_file(test28_files[4], 8L * 1024 * 1024, test28_data, 1, 'x');
+    AsyncTestContext sparse_ctx = {0, 0};
+    char *error_msg_28 = NULL;
+    int ret_28 = compare_files_async(test28_files, 5, 1024 * 1024, 10, async_test_callback, &sparse_ctx,
+                                     &error_msg_28);
+    AsyncTestContext sparse_pair_ctx = {0, 0};
+    if (ret_28 == 0) {
+        ret_28 = compare_files_async(&test28_files[2], 2, 1024 * 1024, 10, async_test_callback, &sparse_pair_ctx,
+                                     &error_msg_28);
+    }
+    if (ret_28 == 0) {
+        ret_28 = compare_files_async(&test28_files[0], 2, 1024 * 1024, 10, async_test_callback, &sparse_pair_ctx,
+                                     &error_msg_28);
+    }
+    if (ret_28 != 0) {
+        printf("ERROR (%d): %s\n", ret_28, error_msg_28 ? error_msg_28 : "No error message.");
+        if (error_msg_28) free_error_message(error_msg_28);
+    } else if (sparse_ctx.sets_found == 1 && sparse_ctx.total_files_in_sets == 3
+               && sparse_pair_ctx.sets_found == 1 && sparse_pair_ctx.total_files_in_sets == 2) {
+        printf("Verification: PASSED (set of 3 sparse files found, pairs told apart)\n");
+    } else {
+        printf("Verification: FAILED (Expected 1 set with 3 files and 1 pair, got %d sets with %d files and %d pairs)\n",
+               sparse_ctx.sets_found, sparse_ctx.total_files_in_sets, sparse_pair_ctx.sets_found);
+    }
+    for (int i = 0; i < 5; i++) {
+        remove(test28_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 29: Async: cached tail and middle blocks compared first ---
+    printf("--- Test: Async: cache probe ---\n");
+    char *test29_files[6];
+    static char test29_content[256 * 1024];
+    for (int i = 0; i < 6; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test29_file%d.bin", i);
+        test29_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test29_content); k++) {
+            test29_content[k] = (char)(k * 7);
+        }
+        // Files just written are cached: 2 differ in the tail, 1 in the middle, 3 are equal
+        if (i < 2) {
+            test29_content[sizeof(test29_content) - 1] = (char) ('a' + i);
+        } else if (i == 2) {
+            test29_content[100000] = 'm';
+        }
+        create_dummy_file_with_size(test29_files[i], test29_content, sizeof(test29_content));
+    }
+    CompareOptions cache_opt;
+    init_compare_options(&cache_opt);
+    cache_opt.max_buffer = 64 * 1024;
+    AsyncTestContext cache_ctx = {0, 0};
+    char *error_msg_29 = NULL;
+    int ret_29 = compare_files_async_opts(test29_files, 6, &cache_opt, async_test_callback, &cache_ctx,
+                                          &error_msg_29);
+    if (ret_29 != 0) {
+        printf("ERROR (%d): %s\n", ret_29, error_msg_29 ? error_msg_29 : "No error message.");
+        if (error_msg_29) free_error_message(error_msg_29);
+    } else if (cache_ctx.sets_found == 1 && cache_ctx.total_files_in_sets == 3) {
+        printf("Verification: PASSED (set of 3 files found)\n");
+    } else {
+        printf("Verification: FAILED (Expected 1 set with 3 files, got %d sets with %d files)\n",
+               cache_ctx.sets_found, cache_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 6; i++) {
+        remove(test29_files[i]);
+        free(test29_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 30: Async: cache neutral reads, read and mmap engines ---
+    printf("--- Test: Async: cache neutral ---\n");
+    char *test30_files[5];
+    static char test30_content[3 * 1024 * 1024];
+    for (int i = 0; i < 5; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test30_file%d.bin", i);
+        test30_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test30_content); k++) {
+            test30_content[k] = (char)(k * 13);
+        }
+        // 1 differs at the start, 1 near the end, 3 are equal
+        if (i == 0) {
+            test30_content[10] = 'a';
+        } else if (i == 1) {
+            test30_content[sizeof(test30_content) - 5000] = 'z';
+        }
+        create_dummy_file_with_size(test30_files[i], test30_content, sizeof(test30_content));
+    }
+    CompareOptions neutral_opt;
+    init_compare_options(&neutral_opt);
+    neutral_opt.max_buffer = 256 * 1024;
+    neutral_opt.cache_neutral = 1;
+    AsyncTestContext neutral_ctx = {0, 0};
+    AsyncTestContext neutral_mmap_ctx = {0, 0};
+    AsyncTestContext neutral_pair_ctx = {0, 0};
+    char *error_msg_30 = NULL;
+    int ret_30 = compare_files_async_opts(test30_files, 5, &neutral_opt, async_test_callback, &neutral_ctx,
+                                          &error_msg_30);
+    if (ret_30 == 0) {
+        neutral_opt.engine = COMPARE_ENGINE_MMAP;
+        ret_30 = compare_files_async_opts(test30_files, 5, &neutral_opt, async_test_callback, &neutral_mmap_ctx,
+                                          &error_msg_30);
+    }
+    if (ret_30 == 0) {
+        neutral_opt.engine = COMPARE_ENGINE_READ;
+        ret_30 = compare_files_async_opts(&test30_files[2], 2, &neutral_opt, async_test_callback,
+                                          &neutral_pair_ctx, &error_msg_30);
+    }
+    if (ret_30 != 0) {
+        printf("ERROR (%d): %s\n", ret_30, error_msg_30 ? error_msg_30 : "No error message.");
+        if (error_msg_30) free_error_message(error_msg_30);
+    } else if (neutral_ctx.sets_found == 1 && neutral_ctx.total_files_in_sets == 3
+               && neutral_mmap_ctx.sets_found == 1 && neutral_mmap_ctx.total_files_in_sets == 3
+               && neutral_pair_ctx.sets_found == 1 && neutral_pair_ctx.total_files_in_sets == 2) {
+        printf("Verification: PASSED (set of 3 files found with both engines, pair found)\n");
+    } else {
+        printf("Verification: FAILED (Expected 1 set with 3 files per engine and 1 pair, got %d/%d, %d/%d and %d/%d)\n",
+               neutral_ctx.sets_found, neutral_ctx.total_files_in_sets, neutral_mmap_ctx.sets_found,
+               neutral_mmap_ctx.total_files_in_sets, neutral_pair_ctx.sets_found,
+               neutral_pair_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 5; i++) {
+        remove(test30_files[i]);
+        free(test30_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 31: Two groups compared at once under the default buffer budget ---
+    printf("--- Test: Async: groups sharing the default budget ---\n");
+    static char *test31_names[2][3];
+    static char test31_content[64 * 1024];
+    for (int g = 0; g < 2; g++) {
+        for (int i = 0; i < 3; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "test31_g%d_file%d.bin", g, i);
+            test31_names[g][i] = strdup(name);
+            for (int k = 0; k < (int) sizeof(test31_content); k++) {
+                test31_content[k] = (char)(k * 3 + g);
+            }
+            // 2 files of each group are equal, the third differs in its last byte
+            if (i == 2) {
+                test31_content[sizeof(test31_content) - 1] = 'z';
+            }
+            create_dummy_file_with_size(test31_names[g][i], test31_content, sizeof(test31_content));
+        }
+    }
+    BudgetTestContext budget_ctx;
+    memset(&budget_ctx, 0, sizeof(budget_ctx));
+    pthread_mutex_init(&budget_ctx.lock, NULL);
+    pthread_cond_init(&budget_ctx.cond, NULL);
+    init_compare_options(&budget_ctx.options);
+    budget_ctx.buffer_free = (size_t) budget_ctx.options.max_buffer;
+    budget_ctx.paths[0] = test31_names[0];
+    budget_ctx.paths[1] = test31_names[1];
+    budget_ctx.count = 3;
+    int test31_groups[2] = {0, 1};
+    wspool budget_pool;
+    int ret_31 = wspool_init(&budget_pool, 2, budget_test_task, &budget_ctx);
+    if (ret_31 == 0) {
+        wspool_submit(&budget_pool, 0, &test31_groups[0]);
+        wspool_submit(&budget_pool, 1, &test31_groups[1]);
+        ret_31 = wspool_run(&budget_pool);
+        wspool_free(&budget_pool);
+    }
+    if (ret_31 == 0) {
+        ret_31 = budget_ctx.ret[0] != 0 ? budget_ctx.ret[0] : budget_ctx.ret[1];
+    }
+    if (ret_31 != 0) {
+        printf("ERROR (%d): comparing the groups failed\n", ret_31);
+    } else if (budget_ctx.max_holding == 2 && budget_ctx.found[0].sets_found == 1
+               && budget_ctx.found[0].total_files_in_sets == 2 && budget_ctx.found[1].sets_found == 1
+               && budget_ctx.found[1].total_files_in_sets == 2) {
+        printf("Verification: PASSED (both groups ran at once, a pair found in each)\n");
+    } else {
+        printf("Verification: FAILED (Expected 2 groups at once with a pair each, got %d at once, %d/%d and %d/%d)\n",
+               budget_ctx.max_holding, budget_ctx.found[0].sets_found, budget_ctx.found[0].total_files_in_sets,
+               budget_ctx.found[1].sets_found, budget_ctx.found[1].total_files_in_sets);
+    }
+    pthread_cond_destroy(&budget_ctx.cond);
+    pthread_mutex_destroy(&budget_ctx.lock);
+    for (int g = 0; g < 2; g++) {
+        for (int i = 0; i < 3; i++) {
+            remove(test31_names[g][i]);
+            free(test31_names[g][i]);
+        }
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 32: Async: hash buckets larger than the buffer and the open files limit ---
+    printf("--- Test: Async: large buckets of equal files ---\n");
+    char *test32_files[40];
+    char test32_content[5000];
+    for (int i = 0; i < 40; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "test32_file%02d.bin", i);
+        test32_files[i] = strdup(name);
+        for (int k = 0; k < (int) sizeof(test32_content); k++) {
+            test32_content[k] = (char)(k * 7);
+        }
+        // 30 and 9 equal files told apart past the first hashed block, and a unique one
+        test32_content[4500] = (char) (i < 30 ? 'a' : 'b');
+        test32_content[100] = (char) (i == 39 ? 'z' : 0);
+        create_dummy_file_with_size(test32_files[i], test32_content, sizeof(test32_content));
+    }
+    AsyncTestContext bucket_ctx = {0, 0};
+    char *error_msg_32 = NULL;
+    int ret_32 = compare_files_async(test32_files, 40, 1024, 4, async_test_callback, &bucket_ctx, &error_msg_32);
+    if (ret_32 != 0) {
+        printf("ERROR (%d): %s\n", ret_32, error_msg_32 ? error_msg_32 : "No error message.");
+        if (error_msg_32) free_error_message(error_msg_32);
+    } else if (bucket_ctx.sets_found == 2 && bucket_ctx.total_files_in_sets == 39) {
+        printf("Verification: PASSED (sets of 30 and 9 files found with a 1024 bytes buffer and 4 open files)\n");
+    } else {
+        printf("Verification: FAILED (Expected 2 sets with 39 files, got %d sets with %d files)\n",
+               bucket_ctx.sets_found, bucket_ctx.total_files_in_sets);
+    }
+    for (int i = 0; i < 40; i++) {
+        remove(test32_files[i]);
+        free(test32_files[i]);
+    }
+    printf("--------------------\n\n");
+
+    // --- Test Case 33: mmap engine: file truncated while it is compared ---
+    printf("--- Test: mmap engine: file shrinking between windows ---\n");
+    const char *test33_name = "test33_file.bin";
+    size_t test33_size = 20 * 1024 * 1024;    // larger than one mapped window
+    char *test33_buf = (char *) calloc(1, 1024 * 1024);
+    FILE *test33_f = fopen(test33_name, "wb");
+    for (size_t written = 0; test33_f != NULL && test33_buf != NULL && written < test33_size;
+         written += 1024 * 1024) {
+        fwrite(test33_buf, 1, 1024 * 1024, test33_f);
+    }
+    if (test33_f != NULL) {
+        fclose(test33_f);
+    }
+    fmanage test33_fm;
+    fm_FILE *test33_ff = NULL;
+    size_t test33_first = 0;
+    size_t test33_past = 1;
+    if (test33_buf != NULL && fm_init(&test33_fm, 4, 1) == 0) {
+        test33_ff = fm_fopen(&test33_fm, (char *) test33_name);
+        if (test33_ff != NULL) {
+            test33_first = fm_pread_at(&test33_fm, test33_ff, test33_buf, 4096, 0);
+            // Truncate to 1 MiB while the first window is still mapped, then read past the new end
+            test33_f = fopen(test33_name, "wb");
+            if (test33_f != NULL) {
+                fwrite(test33_buf, 1, 1024 * 1024, test33_f);
+                fclose(test33_f);
+            }
+            test33_past = fm_pread_at(&test33_fm, test33_ff, test33_buf, 4096, 18 * 1024 * 1024);
+            fm_fclose(&test33_fm, test33_ff);
+        }
+        fm_free(&test33_fm);
+    }
+    if (test33_ff != NULL && test33_first == 4096 && test33_past == 0) {
+        printf("Verification: PASSED (read past the new end returned no data)\n");
+    } else {
+        printf("Verification: FAILED (Expected 4096 then 0 bytes, got %zu then %zu)\n", test33_first, test33_past);
+    }
+    free(test33_buf);
+    remove(test33_name);
+    printf("--------------------\n\n");
+
+    // --- Test Case 34: Extent maps: filesystem key of files in the same filesystem ---
+    printf("--- Test: extent maps: filesystem key ---\n");
+    const char *test34_names[] = {"test34_a.bin", "test34_b.bin"};
+    char *test34_data = (char *) malloc(64 * 1024);
+    if (test34_data != NULL) {
+        memset(test34_data, 'A', 64 * 1024);
+        create_dummy_file_with_size(test34_names[0], test34_data, 64 * 1024);
+        memset(test34_data, 'B', 64 * 1024);
+        create_dummy_file_with_size(test34_names[1], test34_data, 64 * 1024);
+    }
+    fmanage test34_fm;
+    uint64_t test34_fs[2] = {0, 0};
+    int test34_n[2] = {-1, -1};
+    fm_extent test34_ext[16];
+    if (fm_init(&test34_fm, 4, 0) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fm_FILE *ff = fm_fopen(&test34_fm, (char *) test34_names[i]);
+            test34_n[i] = fm_extent_map(&test34_fm, ff, &test34_fs[i], test34_ext, 16);
+            if (ff != NULL) {
+                fm_fclose(&test34_fm, ff);
+            }
+        }
+        fm_free(&test34_fm);
+    }
+    struct stat test34_st;
+    int test34_dev_ok = stat(test34_names[0], &test34_st) == 0;
+    if (test34_n[0] < 0 || test34_n[1] < 0) {
+        printf("Verification: SKIPPED (no extent map here)\n");
+    } else if (test34_fs[0] != test34_fs[1]) {
+        printf("Verification: FAILED (Two files of one filesystem have the keys %llx and %llx)\n",
+               (unsigned long long) test34_fs[0], (unsigned long long) test34_fs[1]);
+    } else if (!fm_reflinks(".") && !(test34_dev_ok && test34_fs[0] == (uint64_t) test34_st.st_dev)) {
+        printf("Verification: FAILED (The key is not the device number outside btrfs)\n");
+    } else {
+        printf("Verification: PASSED (Both files have the key %llx)\n", (unsigned long long) test34_fs[0]);
+    }
+    remove(test34_names[0]);
+    remove(test34_names[1]);
+    printf("--------------------\n\n");
+
+    // --- Test Case 35: Extent maps: reflinked copy in another btrfs subvolume ---
+    printf("--- Test: extent maps: reflink across btrfs subvolumes ---\n");
+    int test35_ready = 0;
+#ifdef __linux__
+    // Only where the scratch directory is on btrfs: the subvolume and the reflink fail elsewhere
+    if (test34_n[0] >= 0 && test34_data != NULL && fm_reflinks(".")
+        && system("btrfs subvolume create test35_sub >/dev/null 2>&1") == 0) {
+        memset(test34_data, 'C', 64 * 1024);
+        create_dummy_file_with_size("test35_a.bin", test34_data, 64 * 1024);
+        test35_ready = system("cp --reflink=always test35_a.bin test35_sub/test35_b.bin 2>/dev/null") == 0;
+    }
+#endif
+    if (!test35_ready) {
+        printf("Verification: SKIPPED (scratch directory is not on btrfs)\n");
+    } else {
+        const char *test35_names[] = {"test35_a.bin", "test35_sub/test35_b.bin"};
+        uint64_t test35_fs[2] = {0, 0};
+        int test35_n[2] = {-1, -1};
+        fm_extent test35_ext[2][16];
+        struct stat test35_st[2];
+        fmanage test35_fm;
+        if (fm_init(&test35_fm, 4, 0) == 0) {
+            for (int i = 0; i < 2; i++) {
+                fm_FILE *ff = fm_fopen(&test35_fm, (char *) test35_names[i]);
+                test35_n[i] = fm_extent_map(&test35_fm, ff, &test35_fs[i], test35_ext[i], 16);
+                if (ff != NULL) {
+                    fm_fclose(&test35_fm, ff);
+                }
+            }
+            fm_free(&test35_fm);
+        }
+        int test35_devs = stat(test35_names[0], &test35_st[0]) == 0 && stat(test35_names[1], &test35_st[1]) == 0
+                          && test35_st[0].st_dev != test35_st[1].st_dev;
+        if (test35_n[0] > 0 && test35_n[0] == test35_n[1] && test35_fs[0] == test35_fs[1] && test35_devs
+            && test35_ext[0][0].physical == test35_ext[1][0].physical) {
+            printf("Verification: PASSED (Subvolumes share the key %llx)\n", (unsigned long long) test35_fs[0]);
+        } else {
+            printf("Verification: FAILED (Reflinked copy in another subvolume has another key or map)\n");
+        }
+        remove(test35_names[1]);
+        remove(test35_names[0]);
+    }
+#ifdef __linux__
+    if (test35_ready || system("test -d test35_sub") == 0) {
+        remove("test35_a.bin");
+        if (system("btrfs subvolume delete test35_sub >/dev/null 2>&1") != 0) {
+            printf("Warning: could not delete the test35_sub subvolume\n");
+        }
+    }
+#endif
+    free(test34_data);
+    printf("--------------------\n\n");
+
     printf("All tests finished.\n");
     return 0;
 }